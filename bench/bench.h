@@ -0,0 +1,34 @@
+#ifndef BENCH_H
+#define BENCH_H
+#include <time.h>
+
+/*
+ * Helpers shared by the benchmark programs, each of which is a single translation unit including this once.
+ */
+
+/*
+ * State of next_rand(), which the program seeds (with anything but 0) before the first call.
+ */
+static unsigned long long rng_state;
+
+/*
+ * xorshift64, so every build or policy a benchmark compares sees exactly the same sequence of requests for the
+ * same seed.
+ */
+static inline unsigned long long next_rand() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/*
+ * @return Seconds on the monotonic clock, for wall clock timings.
+ */
+static inline double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "sfmm.h"
+#include "bench.h"
+
+/*
+ * Replays allocation traces against sf_malloc() and against the system malloc, and reports for each:
+ * throughput, per-operation latency percentiles, peak RSS and heap size, plus sf_utilization() and
+ * sf_fragmentation() for sfmm. Every run is in its own child process, so each one starts from an empty heap.
+ *
+ * Traces are either in the CS:APP malloc lab format (text):
+ *
+ *     <suggested heap size>
+ *     <number of ids>
+ *     <number of operations>
+ *     <weight>
+ *     a <id> <size>        allocate size bytes for id
+ *     r <id> <size>        reallocate id to size bytes
+ *     f <id>               free id
+ *
+ * or in a compact binary form: the magic "SFTR", then for every operation its letter ('a', 'r' or 'f') followed
+ * by the id and, except for 'f', the size, both as LEB128 varints. -c converts the (single) trace given to the
+ * binary form instead of replaying it.
+ *
+ * Payloads are touched once per page when they're allocated, so the peak RSS reflects what was allocated (it also
+ * includes the trace itself, the same for both allocators). The heap size is the peak over the trace, sampled after
+ * every malloc and realloc: for sfmm the heaps, slab pages and mapped chunks, for the system malloc what mallinfo2()
+ * reports as arena and mmapped bytes.
+ * Latencies are measured around each call with clock_gettime(), in a separate run from the throughput, so they
+ * include the timer's own overhead (a few tens of ns). The heap size is sampled in that run as well, between the
+ * timed calls.
+ *
+ * Usage: bench_replay [-n repeats] trace...
+ *        bench_replay -c output trace
+ */
+
+typedef struct {
+    char type;
+    unsigned id;
+    size_t size;
+} trace_op;
+
+typedef struct {
+    const char *name;
+    void *(*malloc)(size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+} allocator;
+
+static const allocator allocators[] = {
+    { "sfmm",  sf_malloc, sf_realloc, sf_free },
+    { "system", malloc,   realloc,    free },
+};
+
+static trace_op *ops;
+static long op_count;
+static unsigned id_count;
+
+static int add_op(char type, unsigned long long id, unsigned long long size) {
+    static long capacity = 0;
+    if((type != 'a' && type != 'r' && type != 'f') || id >= (1U << 31)) return -1;
+    if(op_count == capacity) {
+        capacity = capacity ? 2 * capacity : 4096;
+        ops = realloc(ops, capacity * sizeof(trace_op));
+        if(!ops) return -1;
+    }
+    ops[op_count++] = (trace_op){ type, id, size };
+    if(id >= id_count) id_count = id + 1;
+    return 0;
+}
+
+// The header's counts are only hints, the ids and operations actually present are what's replayed
+static int read_text(FILE *f) {
+    long header[4];
+    for(int i = 0; i < 4; i++) {
+        if(fscanf(f, "%ld", header + i) != 1) return -1;
+    }
+    char type;
+    unsigned long long id, size = 0;
+    while(fscanf(f, " %c %llu", &type, &id) == 2) {
+        if(type != 'f' && fscanf(f, "%llu", &size) != 1) return -1;
+        if(add_op(type, id, type == 'f' ? 0 : size)) return -1;
+    }
+    return feof(f) ? 0 : -1;
+}
+
+static int read_varint(FILE *f, unsigned long long *value) {
+    *value = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        int c = getc(f);
+        if(c == EOF) return -1;
+        *value |= (unsigned long long)(c & 0x7F) << shift;
+        if(!(c & 0x80)) return 0;
+    }
+    return -1;
+}
+
+static void write_varint(FILE *f, unsigned long long value) {
+    while(value >= 0x80) {
+        putc((value & 0x7F) | 0x80, f);
+        value >>= 7;
+    }
+    putc(value, f);
+}
+
+static int read_binary(FILE *f) {
+    int type;
+    while((type = getc(f)) != EOF) {
+        unsigned long long id, size = 0;
+        if(read_varint(f, &id)) return -1;
+        if(type != 'f' && read_varint(f, &size)) return -1;
+        if(add_op(type, id, size)) return -1;
+    }
+    return 0;
+}
+
+static int load_trace(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if(!f) {
+        perror(path);
+        return -1;
+    }
+    op_count = 0;
+    id_count = 0;
+    char magic[4];
+    int binary = fread(magic, 1, 4, f) == 4 && !memcmp(magic, "SFTR", 4);
+    if(!binary) rewind(f);
+    int ret = binary ? read_binary(f) : read_text(f);
+    fclose(f);
+    if(ret) fprintf(stderr, "%s: malformed trace\n", path);
+    return ret;
+}
+
+static int convert(const char *input, const char *output) {
+    if(load_trace(input)) return EXIT_FAILURE;
+    FILE *f = fopen(output, "wb");
+    if(!f) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+    fwrite("SFTR", 1, 4, f);
+    for(long i = 0; i < op_count; i++) {
+        putc(ops[i].type, f);
+        write_varint(f, ops[i].id);
+        if(ops[i].type != 'f') write_varint(f, ops[i].size);
+    }
+    if(fclose(f)) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+    printf("%s: %ld operations, %u ids\n", output, op_count, id_count);
+    return EXIT_SUCCESS;
+}
+
+// Writes one byte per page, so the pages are really allocated
+static void touch(char *pp, size_t size) {
+    for(size_t i = 0; i < size; i += PAGE_SZ) pp[i] = 1;
+    if(size) pp[size - 1] = 1;
+}
+
+static size_t heap_size(const allocator *a) {
+    if(a -> malloc != sf_malloc) {
+        struct mallinfo2 info = mallinfo2();
+        return info.arena + info.hblkhd;
+    }
+    size_t size = sf_mmap_size();
+    for(int i = 0; i < SF_MAX_ARENAS; i++) {
+        size += (char *)sf_heap_end(i) - (char *)sf_heap_start(i);
+        size += (char *)sf_slab_end(i) - (char *)sf_slab_start(i);
+    }
+    return size;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Replays the trace repeats times. With latencies set, every call is timed and its latency (in ns) is stored there,
+ * and the peak heap size is stored in *peak.
+ * Returns the elapsed time, or -1 if an allocation failed.
+ */
+static double replay(const allocator *a, int repeats, float *latencies, size_t *peak) {
+    void **ptrs = calloc(id_count, sizeof(void *));
+    size_t *sizes = calloc(id_count, sizeof(size_t));
+    if(!ptrs || !sizes) return -1;
+
+    double elapsed = 0;
+    long timed = 0;
+    for(int r = 0; r < repeats; r++) {
+        double start = now();
+        for(long i = 0; i < op_count; i++) {
+            trace_op *op = ops + i;
+            void *pp = ptrs[op -> id];
+            double t0 = latencies ? now() : 0;
+            switch(op -> type) {
+                case 'a':
+                    pp = a -> malloc(op -> size);
+                    break;
+                case 'r':
+                    pp = pp ? a -> realloc(pp, op -> size) : a -> malloc(op -> size);
+                    break;
+                case 'f':
+                    if(pp) a -> free(pp);
+                    pp = NULL;
+                    break;
+            }
+            if(latencies) latencies[timed++] = (now() - t0) * 1e9;
+            if(op -> type != 'f') {
+                if(!pp && op -> size) {
+                    fprintf(stderr, "%s: %s of %zu bytes failed at operation %ld\n", a -> name,
+                            op -> type == 'a' ? "malloc" : "realloc", op -> size, i);
+                    return -1;
+                }
+                // Only the part a realloc added needs touching, so it isn't counted twice
+                size_t old = op -> type == 'r' && ptrs[op -> id] ? sizes[op -> id] : 0;
+                if(pp && op -> size > old) touch((char *)pp + old, op -> size - old);
+                sizes[op -> id] = op -> size;
+                if(latencies) {
+                    size_t size = heap_size(a);
+                    if(size > *peak) *peak = size;
+                }
+            }
+            ptrs[op -> id] = pp;
+        }
+        elapsed += now() - start;
+
+        // Whatever the trace didn't free, so the next repeat starts over (not timed). The statistics are
+        // reported with the last repeat's objects still allocated.
+        if(r == repeats - 1) break;
+        for(unsigned id = 0; id < id_count; id++) {
+            if(ptrs[id]) a -> free(ptrs[id]);
+            ptrs[id] = NULL;
+        }
+    }
+    return elapsed;
+}
+
+// What the timed run sends back: the p50, p99 and p999 latencies (-1 on failure) and the peak heap size
+typedef struct {
+    float pct[3];
+    size_t peak;
+} latency_result;
+
+// Replays the trace with every call timed, and sends the latency percentiles and peak heap size through fd
+static int run_latency(const allocator *a, int repeats, int fd) {
+    long n = op_count * repeats;
+    float *latencies = malloc(n * sizeof(float));
+    latency_result result = { { -1, -1, -1 }, 0 };
+    if(latencies && replay(a, repeats, latencies, &result.peak) >= 0) {
+        qsort(latencies, n, sizeof(float), compare_latency);
+        result.pct[0] = latencies[n / 2];
+        result.pct[1] = latencies[n * 99 / 100];
+        result.pct[2] = latencies[n * 999 / 1000];
+    }
+    return write(fd, &result, sizeof(result)) == sizeof(result) && result.pct[0] >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int run(const allocator *a, const char *trace, int repeats) {
+    // Latencies come from a child of their own, which starts from the same empty heap, since timing every call
+    // skews the throughput
+    latency_result result = { { -1, -1, -1 }, 0 };
+    float *pct = result.pct;
+    int pipefd[2];
+    if(pipe(pipefd)) return EXIT_FAILURE;
+    pid_t pid = fork();
+    if(pid == 0) {
+        close(pipefd[0]);
+        _exit(run_latency(a, repeats, pipefd[1]));
+    }
+    close(pipefd[1]);
+    if(pid < 0 || read(pipefd[0], &result, sizeof(result)) != sizeof(result)) pct[0] = pct[1] = pct[2] = -1;
+    close(pipefd[0]);
+    if(pid > 0) waitpid(pid, NULL, 0);
+
+    double elapsed = replay(a, repeats, NULL, NULL);
+    if(elapsed < 0) return EXIT_FAILURE;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    char util[16] = "-", frag[16] = "-";
+    if(a -> malloc == sf_malloc) {
+        snprintf(util, sizeof(util), "%.4f", sf_utilization());
+        snprintf(frag, sizeof(frag), "%.4f", sf_fragmentation());
+    }
+
+    printf("%-24.24s %-7s %12.0f %8.0f %8.0f %8.0f %12ld %12zu %8s %8s\n", trace, a -> name,
+           op_count * repeats / elapsed, pct[0], pct[1], pct[2], usage.ru_maxrss, result.peak, util, frag);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    int repeats = 1;
+    const char *output = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "n:c:")) != -1) {
+        if(opt == 'n') repeats = atoi(optarg);
+        else if(opt == 'c') output = optarg;
+        else repeats = 0;
+    }
+    if(repeats <= 0 || optind >= argc || (output && optind != argc - 1)) {
+        fprintf(stderr, "usage: %s [-n repeats] trace...\n       %s -c output trace\n", argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+    if(output) return convert(argv[optind], output);
+
+    printf("%-24s %-7s %12s %8s %8s %8s %12s %12s %8s %8s\n", "trace", "malloc", "ops/sec", "p50 ns", "p99 ns",
+           "p999 ns", "peak RSS KB", "heap bytes", "util", "frag");
+    fflush(stdout);
+
+    int status = EXIT_SUCCESS;
+    for(int t = optind; t < argc; t++) {
+        if(load_trace(argv[t])) {
+            status = EXIT_FAILURE;
+            continue;
+        }
+        const char *name = strrchr(argv[t], '/') ? strrchr(argv[t], '/') + 1 : argv[t];
+        for(size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+            pid_t pid = fork();
+            if(pid < 0) {
+                perror("fork");
+                return EXIT_FAILURE;
+            }
+            if(pid == 0) {
+                int ret = run(allocators + i, name, repeats);
+                fflush(stdout);
+                _exit(ret);
+            }
+            int child;
+            if(waitpid(pid, &child, 0) < 0 || !WIFEXITED(child) || WEXITSTATUS(child) != EXIT_SUCCESS)
+                status = EXIT_FAILURE;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sfmm.h"
+#include "bench.h"
+
+/*
+ * Times sf_free() against the length of the free list it works on. For each length N, 4N blocks of one main free
+ * list size are allocated back to back and every fourth one is freed, which leaves N free blocks in the same list,
+ * none of them next to another. Then SAMPLES blocks spread over the heap are freed and timed, of two kinds:
+ *
+ *     plain     both neighbours allocated, so the block is only inserted into the list
+ *     coalesce  the block before it is free, so that one has to be taken out of the list of N to merge with it
+ *
+ * Neither should depend on N, a free that searched the list for the neighbour it unlinks would grow with it.
+ * Every length runs in its own child process, so each one starts from an empty heap.
+ *
+ * Usage: free_bench [max length]
+ */
+
+#define DEFAULT_MAX_LENGTH 65536
+#define MIN_LENGTH 1024
+#define SAMPLES 1024
+// Above the slab and quick list sizes (and far below the mmap threshold), so every free goes to a main free list
+#define SIZE 300
+
+static int run(long length) {
+    void **blocks = malloc(4 * length * sizeof(void *));
+    if(!blocks) return EXIT_FAILURE;
+    for(long i = 0; i < 4 * length; i++) {
+        if(!(blocks[i] = sf_malloc(SIZE))) {
+            fprintf(stderr, "sf_malloc failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    for(long i = 0; i < length; i++) sf_free(blocks[4 * i]);
+
+    // Block 4k + 2 has allocated neighbours, block 4k + 1 a free one before it; plain and coalescing frees take
+    // turns over the groups so neither changes the neighbours of the other
+    long samples = length / 2 < SAMPLES ? length / 2 : SAMPLES;
+    long stride = length / samples;
+    double start = now();
+    for(long j = 0; j < samples; j++) sf_free(blocks[4 * (j * stride) + 2]);
+    double plain = now() - start;
+    start = now();
+    for(long j = 0; j < samples; j++) sf_free(blocks[4 * (j * stride + 1) + 1]);
+    double coalesce = now() - start;
+
+    printf("%12ld %12.1f %12.1f\n", length, plain * 1e9 / samples, coalesce * 1e9 / samples);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char const *argv[]) {
+    long max_length = argc > 1 ? atol(argv[1]) : DEFAULT_MAX_LENGTH;
+    if(max_length < MIN_LENGTH) {
+        fprintf(stderr, "usage: %s [max length, at least %d]\n", argv[0], MIN_LENGTH);
+        return EXIT_FAILURE;
+    }
+
+    printf("%12s %12s %12s\n", "free blocks", "plain ns", "coalesce ns");
+    fflush(stdout);
+
+    int status = EXIT_SUCCESS;
+    for(long length = MIN_LENGTH; length <= max_length; length *= 4) {
+        pid_t pid = fork();
+        if(pid < 0) {
+            perror("fork");
+            return EXIT_FAILURE;
+        }
+        if(pid == 0) {
+            int ret = run(length);
+            fflush(stdout);
+            _exit(ret);
+        }
+        int child;
+        if(waitpid(pid, &child, 0) < 0 || !WIFEXITED(child) || WEXITSTATUS(child) != EXIT_SUCCESS)
+            status = EXIT_FAILURE;
+    }
+    return status;
+}
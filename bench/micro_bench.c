@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "sfmm.h"
+
+/*
+ * Times the allocator's fast paths one size class at a time: every quick list class (QL_INDEX 0 to 11),
+ * one size in each first-level class of the main free lists below the mmap threshold, and a few sizes
+ * in the mapped range. For each size it prints the cycles per call for:
+ *
+ *     pair      malloc immediately followed by free of the same size
+ *     lifo      LIVE mallocs, then their frees in reverse order
+ *     fifo      LIVE mallocs, then their frees in allocation order
+ *     realloc   a growth chain, malloc then REALLOC_STEPS reallocs growing by a quarter each, then free
+ *     hit       malloc of a size that was just freed, so it comes straight off a cache (or the exact fit)
+ *     miss      mallocs in bulk, so the caches keep running dry and are refilled from the main free lists
+ *     batch     the same as lifo, with one sf_malloc_batch() and one sf_free_batch() call per LIVE objects
+ *     region    LIVE sf_region_alloc() calls, then one sf_region_reset(), counted as two calls per object
+ *               like the others (sizes above a quarter of SF_REGION_CHUNK_SIZE get chunks of their own)
+ *
+ * Each figure is the best of REPEATS runs, which makes them steady enough to compare between builds.
+ * With slabs (the default build) the quick list sizes are served from slabs, `make bench` also builds
+ * bin/micro_bench_noslabs with SF_SLABS=0 so the quick lists themselves are measured, and
+ * bin/micro_bench_notcache with TCACHE_MAX=0 as well, which bypasses the thread caches: a hit is then popQL()
+ * under the arena's lock and a miss find_fit(), instead of a pop from the cache and a refill of it.
+ * Cycles are TSC ticks on x86-64 (reference cycles, not core cycles) and nanoseconds elsewhere.
+ *
+ * Usage: micro_bench [iterations]
+ */
+
+#define DEFAULT_ITERATIONS 100000
+#define REPEATS 5
+#define LIVE 256
+#define HIT_BATCH 4
+#define REALLOC_STEPS 8
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+static inline unsigned long long cycles() {
+    return __rdtsc();
+}
+#else
+static inline unsigned long long cycles() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+static void *live[LIVE];
+static sf_region *region;
+static int failed;
+
+static void *checked_malloc(size_t size) {
+    void *pp = sf_malloc(size);
+    if(!pp) failed = 1;
+    return pp;
+}
+
+static const char *path_name(size_t size) {
+    if(size >= sf_get_mmap_threshold()) return "mmap";
+    if(SF_SLABS && size <= SLAB_MAX_SIZE) return "slab";
+    // A payload of size needs a block of at most size + 16 bytes, the quick lists hold blocks below 224
+    if(size + 16 < 224) return "quick";
+    return "main";
+}
+
+static double run_pair(size_t size, long iterations) {
+    unsigned long long start = cycles();
+    for(long i = 0; i < iterations; i++) sf_free(checked_malloc(size));
+    return (double)(cycles() - start) / (2 * iterations);
+}
+
+static double run_order(size_t size, long rounds, int lifo) {
+    unsigned long long start = cycles();
+    for(long r = 0; r < rounds; r++) {
+        for(int i = 0; i < LIVE; i++) live[i] = checked_malloc(size);
+        if(lifo) {
+            for(int i = LIVE - 1; i >= 0; i--) sf_free(live[i]);
+        } else {
+            for(int i = 0; i < LIVE; i++) sf_free(live[i]);
+        }
+    }
+    return (double)(cycles() - start) / (2 * LIVE * rounds);
+}
+
+static double run_realloc(size_t size, long chains) {
+    unsigned long long start = cycles();
+    for(long c = 0; c < chains; c++) {
+        size_t rsize = size;
+        void *pp = checked_malloc(rsize);
+        for(int i = 0; i < REALLOC_STEPS && pp; i++) {
+            rsize += rsize / 4 < 16 ? 16 : rsize / 4;
+            void *grown = sf_realloc(pp, rsize);
+            if(!grown) failed = 1;
+            else pp = grown;
+        }
+        sf_free(pp);
+    }
+    return (double)(cycles() - start) / ((REALLOC_STEPS + 2) * chains);
+}
+
+// Only the mallocs are timed, the frees in between put the blocks back where the next mallocs find them
+static double run_hit(size_t size, long rounds) {
+    unsigned long long total = 0;
+    for(int i = 0; i < HIT_BATCH; i++) live[i] = checked_malloc(size);
+    for(long r = 0; r < rounds; r++) {
+        for(int i = 0; i < HIT_BATCH; i++) sf_free(live[i]);
+        unsigned long long start = cycles();
+        for(int i = 0; i < HIT_BATCH; i++) live[i] = checked_malloc(size);
+        total += cycles() - start;
+    }
+    for(int i = 0; i < HIT_BATCH; i++) sf_free(live[i]);
+    return (double)total / (HIT_BATCH * rounds);
+}
+
+static double run_miss(size_t size, long rounds) {
+    unsigned long long total = 0;
+    for(long r = 0; r < rounds; r++) {
+        unsigned long long start = cycles();
+        for(int i = 0; i < LIVE; i++) live[i] = checked_malloc(size);
+        total += cycles() - start;
+        for(int i = 0; i < LIVE; i++) sf_free(live[i]);
+    }
+    return (double)total / (LIVE * rounds);
+}
+
+static double run_batch(size_t size, long rounds) {
+    unsigned long long start = cycles();
+    for(long r = 0; r < rounds; r++) {
+        if(sf_malloc_batch(size, LIVE, live) != LIVE) {
+            failed = 1;
+            return 0;
+        }
+        sf_free_batch(live, LIVE);
+    }
+    return (double)(cycles() - start) / (2 * LIVE * rounds);
+}
+
+static double run_region(size_t size, long rounds) {
+    unsigned long long start = cycles();
+    for(long r = 0; r < rounds; r++) {
+        for(int i = 0; i < LIVE; i++) {
+            if(!sf_region_alloc(region, size)) {
+                failed = 1;
+                return 0;
+            }
+        }
+        sf_region_reset(region);
+    }
+    return (double)(cycles() - start) / (2 * LIVE * rounds);
+}
+
+// Best of REPEATS runs of the benchmark
+static double best(double (*bench)(size_t, long), size_t size, long iterations) {
+    double min = -1;
+    for(int i = 0; i < REPEATS; i++) {
+        double t = bench(size, iterations);
+        if(min < 0 || t < min) min = t;
+    }
+    return min;
+}
+
+static double run_lifo(size_t size, long rounds) {
+    return run_order(size, rounds, 1);
+}
+
+static double run_fifo(size_t size, long rounds) {
+    return run_order(size, rounds, 0);
+}
+
+static void measure(const char *name, size_t size, long iterations) {
+    // Mappings cost a system call or two each, so they get far fewer iterations
+    if(size >= sf_get_mmap_threshold()) iterations = iterations / 100 > 0 ? iterations / 100 : 1;
+    long rounds = iterations / LIVE > 0 ? iterations / LIVE : 1;
+    double pair = best(run_pair, size, iterations);
+    double lifo = best(run_lifo, size, rounds);
+    double fifo = best(run_fifo, size, rounds);
+    double chain = best(run_realloc, size, iterations / REALLOC_STEPS > 0 ? iterations / REALLOC_STEPS : 1);
+    double hit = best(run_hit, size, iterations / HIT_BATCH > 0 ? iterations / HIT_BATCH : 1);
+    double miss = best(run_miss, size, rounds);
+    double batch = best(run_batch, size, rounds);
+    double bump = best(run_region, size, rounds);
+    printf("%-8s %9zu %-6s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, size, path_name(size), pair,
+           lifo, fifo, chain, hit, miss, batch, bump);
+}
+
+int main(int argc, char const *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    if(iterations <= 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+#ifdef TCACHE_MAX
+    printf("SF_SLABS=%d SF_OBF_MODE=%d TCACHE_MAX=%d, cycles per call\n", SF_SLABS, SF_OBF_MODE, TCACHE_MAX);
+#else
+    printf("SF_SLABS=%d SF_OBF_MODE=%d, cycles per call\n", SF_SLABS, SF_OBF_MODE);
+#endif
+    printf("%-8s %9s %-6s %9s %9s %9s %9s %9s %9s %9s %9s\n", "class", "size", "path", "pair", "lifo", "fifo",
+           "realloc", "hit", "miss", "batch", "region");
+    if(!(region = sf_region_create(0))) {
+        fprintf(stderr, "sf_region_create failed\n");
+        return EXIT_FAILURE;
+    }
+    char name[16];
+    // Quick list i holds blocks of 32 + 16 * i bytes, the largest payload that fits is 16 bytes less
+    for(int i = 0; i < NUM_QUICK_LISTS; i++) {
+        snprintf(name, sizeof(name), "ql%d", i);
+        measure(name, 16 + 16 * i, iterations);
+    }
+    // First-level class fl of the main lists holds blocks of SMALL_BLOCK_SIZE << (fl - 1) up to twice that,
+    // take a block size halfway through (class 0 is the sizes between the quick lists and SMALL_BLOCK_SIZE)
+    measure("fl0", SMALL_BLOCK_SIZE - 32, iterations);
+    for(int fl = 1; ((size_t)SMALL_BLOCK_SIZE << fl) <= sf_get_mmap_threshold(); fl++) {
+        snprintf(name, sizeof(name), "fl%d", fl);
+        measure(name, ((size_t)SMALL_BLOCK_SIZE << (fl - 1)) * 3 / 2 - 16, iterations);
+    }
+    for(size_t size = sf_get_mmap_threshold(); size <= 16 * sf_get_mmap_threshold(); size *= 4)
+        measure("mmap", size, iterations);
+
+    sf_region_destroy(region);
+
+    if(failed) {
+        fprintf(stderr, "sf_malloc failed\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
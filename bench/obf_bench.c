@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "sfmm.h"
+#include "bench.h"
+
+/*
+ * Measures sf_malloc()/sf_free() on the heap path (requests too large for slabs and quick lists), where every
+ * block touched decodes headers and footers. `make bench` builds this once per obfuscation mode, as
+ * bin/obf_bench_0, bin/obf_bench_1 and bin/obf_bench_2 (see SF_OBF_MODE in sfmm.h), so the modes can be compared.
+ *
+ * Usage: obf_bench_<mode> [ops] [seed]
+ */
+
+#define DEFAULT_OPS 2000000
+#define LIVE 4096
+
+// Allocates and immediately frees the same size, so every pair splits a block and coalesces it back
+static double run_pairs(long ops) {
+    double start = now();
+    for(long i = 0; i < ops; i++) {
+        void *pp = sf_malloc(1000);
+        if(!pp) return -1;
+        sf_free(pp);
+    }
+    return (now() - start) * 1e9 / (2 * ops);
+}
+
+// Random frees and allocations over a set of live blocks, so fits are searched and neighbours coalesced
+static double run_mixed(long ops) {
+    static void *slots[LIVE];
+    double start = now();
+    for(long i = 0; i < ops; i++) {
+        long slot = next_rand() % LIVE;
+        if(slots[slot]) {
+            sf_free(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = sf_malloc(SLAB_MAX_SIZE + 1 + next_rand() % 4096);
+            if(!slots[slot]) return -1;
+        }
+    }
+    double elapsed = now() - start;
+    for(long slot = 0; slot < LIVE; slot++) {
+        if(slots[slot]) sf_free(slots[slot]);
+        slots[slot] = NULL;
+    }
+    return elapsed * 1e9 / ops;
+}
+
+int main(int argc, char const *argv[]) {
+    long ops = argc > 1 ? atol(argv[1]) : DEFAULT_OPS;
+    rng_state = argc > 2 ? strtoull(argv[2], NULL, 0) : 88172645463325252ULL;
+    if(ops <= 0 || rng_state == 0) {
+        fprintf(stderr, "usage: %s [ops] [seed]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Warm up first, so the heap is already grown and its pages are mapped in when measuring
+    run_mixed(ops / 4);
+    double pairs = run_pairs(ops);
+    double mixed = run_mixed(ops);
+    if(pairs < 0 || mixed < 0) {
+        fprintf(stderr, "sf_malloc failed\n");
+        return EXIT_FAILURE;
+    }
+    printf("SF_OBF_MODE=%d  malloc/free pairs: %6.1f ns/op  mixed: %6.1f ns/op\n", SF_OBF_MODE, pairs, mixed);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sfmm.h"
+#include "bench.h"
+
+/*
+ * Runs the same synthetic workload once per placement policy and reports throughput,
+ * heap size, sf_utilization() and sf_fragmentation() for each.
+ * Every policy runs in its own child process so each one starts from an empty heap.
+ *
+ * Usage: policy_report [ops] [live objects] [seed]
+ */
+
+#define DEFAULT_OPS  1000000
+#define DEFAULT_LIVE 20000
+
+// Mostly small objects, some medium and a few large ones
+static size_t next_size() {
+    unsigned r = next_rand() % 100;
+    if(r < 70) return 1 + next_rand() % 256;
+    if(r < 95) return 1 + next_rand() % 4096;
+    return 1 + next_rand() % 65536;
+}
+
+static int run(sf_fit_policy policy, long ops, long live, unsigned long long seed) {
+    if(sf_set_policy(policy)) {
+        fprintf(stderr, "unable to select policy %s\n", sf_policy_name(policy));
+        return EXIT_FAILURE;
+    }
+    void **slots = calloc(live, sizeof(void *));
+    if(!slots) return EXIT_FAILURE;
+
+    rng_state = seed;
+    double start = now();
+    for(long i = 0; i < ops; i++) {
+        long slot = next_rand() % live;
+        if(slots[slot]) {
+            sf_free(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            size_t size = next_size();
+            slots[slot] = sf_malloc(size);
+            if(!slots[slot]) {
+                fprintf(stderr, "%s: sf_malloc(%zu) failed\n", sf_policy_name(policy), size);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    double elapsed = now() - start;
+
+    // Measured with the workload's live objects still allocated, over every heap and its slab pages
+    size_t heap_size = 0;
+    for(int i = 0; i < SF_MAX_ARENAS; i++) {
+        heap_size += (char *)sf_heap_end(i) - (char *)sf_heap_start(i);
+        heap_size += (char *)sf_slab_end(i) - (char *)sf_slab_start(i);
+    }
+    printf("%-8s %12.0f %12zu %12.4f %14.4f\n", sf_policy_name(policy), ops / elapsed,
+           heap_size, sf_utilization(), sf_fragmentation());
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char const *argv[]) {
+    long ops = argc > 1 ? atol(argv[1]) : DEFAULT_OPS;
+    long live = argc > 2 ? atol(argv[2]) : DEFAULT_LIVE;
+    unsigned long long seed = argc > 3 ? strtoull(argv[3], NULL, 0) : 88172645463325252ULL;
+    if(ops <= 0 || live <= 0 || seed == 0) {
+        fprintf(stderr, "usage: %s [ops] [live objects] [seed]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-8s %12s %12s %12s %14s\n", "policy", "ops/sec", "heap bytes", "utilization", "fragmentation");
+    fflush(stdout);
+
+    int status = EXIT_SUCCESS;
+    for(sf_fit_policy policy = SF_FIT_GOOD; policy <= SF_FIT_NEXT; policy++) {
+        pid_t pid = fork();
+        if(pid < 0) {
+            perror("fork");
+            return EXIT_FAILURE;
+        }
+        if(pid == 0) {
+            int ret = run(policy, ops, live, seed);
+            fflush(stdout);
+            _exit(ret);
+        }
+        int child;
+        if(waitpid(pid, &child, 0) < 0 || !WIFEXITED(child) || WEXITSTATUS(child) != EXIT_SUCCESS)
+            status = EXIT_FAILURE;
+    }
+    return status;
+}
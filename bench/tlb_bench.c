@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "sfmm.h"
+#include "bench.h"
+
+/*
+ * Measures the TLB cost of the free list walks on a large heap. A live set of objects is allocated,
+ * then a random one is freed and replaced by one of another random size, over and over, so find_fit()
+ * and coalesce() keep touching blocks spread over the whole heap. Sizes are all above the slab and
+ * quick list range, so every request goes through the main free lists.
+ *
+ * Data TLB load and store misses and cycles of the replacement phase are counted with perf_event_open()
+ * (user space only, so a perf_event_paranoid of 2 is enough), and printed as n/a when the counter isn't
+ * available, as is often the case in a VM. `make bench` builds this twice: bin/tlb_bench with 4KB pages
+ * and bin/tlb_bench_huge with SF_HUGE_PAGES=1, run both with the same arguments to compare them.
+ * AnonHugePages is how much of the process the kernel actually backs with transparent huge pages.
+ *
+ * Usage: tlb_bench [live objects] [ops] [seed]
+ */
+
+#define DEFAULT_LIVE 100000
+#define DEFAULT_OPS  2000000
+#define MIN_SIZE     300
+#define MAX_SIZE     8192
+
+static size_t next_size() {
+    return MIN_SIZE + next_rand() % (MAX_SIZE - MIN_SIZE + 1);
+}
+
+// Opens a disabled user space counter of the calling thread, -1 if it isn't available
+static int open_counter(unsigned type, unsigned long long config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#define DTLB(op) (PERF_COUNT_HW_CACHE_DTLB | (op) << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+static const char *counter_names[] = { "dTLB-load-misses", "dTLB-store-misses", "cycles" };
+
+static void print_counter(const char *name, int fd, long ops) {
+    long long count;
+    if(fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+        printf("%-20s %14s\n", name, "n/a");
+        return;
+    }
+    printf("%-20s %14lld %12.3f per op\n", name, count, (double)count / ops);
+}
+
+static long anon_huge_kb() {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if(!f) return -1;
+    char line[256];
+    long kb = -1;
+    while(fgets(line, sizeof(line), f)) {
+        if(sscanf(line, "AnonHugePages: %ld", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+int main(int argc, char const *argv[]) {
+    long live = argc > 1 ? atol(argv[1]) : DEFAULT_LIVE;
+    long ops = argc > 2 ? atol(argv[2]) : DEFAULT_OPS;
+    rng_state = argc > 3 ? strtoull(argv[3], NULL, 10) : 88172645463325252ULL;
+    if(live <= 0 || ops <= 0 || rng_state == 0) {
+        fprintf(stderr, "usage: %s [live objects] [ops] [seed]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    void **slots = calloc(live, sizeof(void *));
+    if(!slots) return EXIT_FAILURE;
+    for(long i = 0; i < live; i++) {
+        if(!(slots[i] = sf_malloc(next_size()))) {
+            fprintf(stderr, "sf_malloc failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    int counters[] = {
+        open_counter(PERF_TYPE_HW_CACHE, DTLB(PERF_COUNT_HW_CACHE_OP_READ)),
+        open_counter(PERF_TYPE_HW_CACHE, DTLB(PERF_COUNT_HW_CACHE_OP_WRITE)),
+        open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES),
+    };
+    int ncounters = sizeof(counters) / sizeof(counters[0]);
+    for(int i = 0; i < ncounters; i++) {
+        if(counters[i] >= 0) ioctl(counters[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double start = now();
+    for(long i = 0; i < ops; i++) {
+        long slot = next_rand() % live;
+        sf_free(slots[slot]);
+        if(!(slots[slot] = sf_malloc(next_size()))) {
+            fprintf(stderr, "sf_malloc failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    double elapsed = now() - start;
+    for(int i = 0; i < ncounters; i++) {
+        if(counters[i] >= 0) ioctl(counters[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    size_t heap_size = 0;
+    for(int i = 0; i < SF_MAX_ARENAS; i++) heap_size += (char *)sf_heap_end(i) - (char *)sf_heap_start(i);
+    printf("SF_HUGE_PAGES=%d, %ld live objects, %ld ops\n", SF_HUGE_PAGES, live, ops);
+    printf("%-20s %14.1f ns per op\n", "time", elapsed * 1e9 / ops);
+    for(int i = 0; i < ncounters; i++) print_counter(counter_names[i], counters[i], ops);
+    printf("%-20s %14zu KB\n", "heap", heap_size >> 10);
+    printf("%-20s %14ld KB\n", "AnonHugePages", anon_huge_kb());
+    return EXIT_SUCCESS;
+}
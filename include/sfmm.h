@@ -1,8 +1,14 @@
 /**
  * DISCLAIMER:
- * THIS FILE WAS INCLUDED IN THE ORIGINAL ASSIGNMENT AS STARTER CODE.
- * IT WAS PROVIDED AND WRITTEN BY THE INSTRUCTOR AND IS NOT MY WORK.
- * MY WORK IS CONTAINED IN THE sfmm.c AND main.c FILES.
+ * THIS FILE STARTED AS STARTER CODE OF THE ORIGINAL ASSIGNMENT, PROVIDED AND WRITTEN BY THE INSTRUCTOR.
+ * ONLY THESE PARTS ARE THE INSTRUCTOR'S WORK: THE BLOCK AND HEAP FORMAT DIAGRAMS, THE HEADER BITS AND
+ * struct sf_block, THE FIRST PARAGRAPH OF THE QUICK LIST AND FREE LIST DESCRIPTIONS, THE FIRST PARAGRAPH
+ * OF THE COMMENTS ON sf_malloc(), sf_realloc(), sf_free(), sf_fragmentation() AND sf_utilization(), AND
+ * THE DECLARATIONS OF sf_mem_start(), sf_mem_end(), sf_mem_grow(), PAGE_SZ, sf_magic(), sf_set_magic()
+ * AND THE sf_show_*() FUNCTIONS.
+ * EVERYTHING ELSE (ARENAS, PLACEMENT POLICIES, THREAD CACHES, SLABS, MAPPED CHUNKS, BATCHES, REGIONS,
+ * TRIMMING, THE PROFILER, THE PER-HEAP PROVIDER FUNCTIONS AND THE BUILD OPTIONS) IS MY WORK, AS ARE
+ * sfmm.c, sfutil.c AND THE OTHER SOURCE FILES.
  */
 #ifndef SFMM_H
 #define SFMM_H
@@ -10,6 +16,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
 
                                  Format of an allocated memory block
@@ -95,6 +105,23 @@
 
 #define THIS_BLOCK_ALLOCATED  0x1
 #define IN_QUICK_LIST         0x2
+#define PREV_BLOCK_ALLOCATED  0x4
+#define IS_MMAPPED            0x8
+
+/*
+ * The lower of the two unused bits in the diagrams above is PREV_BLOCK_ALLOCATED.  It's set in
+ * the header of every block (and the footer of a free block, which still matches its header) whose
+ * preceding block has its alloc bit set, so quick list blocks and the prologue count as allocated.
+ * The epilogue carries it as well.
+ *
+ * With SF_FOOTER_ELISION enabled, allocated and quick list blocks have no footer: their last row
+ * is part of the payload, and the previous block's footer is only read when this bit says the
+ * previous block is free.  A block then needs one row of overhead instead of two.
+ */
+
+#ifndef SF_FOOTER_ELISION
+#define SF_FOOTER_ELISION 0
+#endif
 
 typedef size_t sf_header;
 typedef size_t sf_footer;
@@ -176,16 +203,20 @@ typedef struct sf_block {
 */
 
 /* sf_errno: will be set on error */
-int sf_errno;
+extern __thread int sf_errno;
 
 /*
  * "Quick lists":  These are used to hold recently freed blocks of small sizes, so that they
  * can be used to satisfy allocations without searching lists or splitting blocks.
  * Blocks on a quick list are marked as allocated, so they are not available for coalescing.
- * The number of blocks in any individual quick list is limited to QUICK_LIST_MAX.
- * If adding a block to a quick list would cause it to exceed QUICK_LIST_MAX, then the
- * list is flushed, returning the existing blocks in the list to the main pool, and then
- * the block being freed is added to the now-empty list, leaving that list containing one block.
+ * A block of a quick list size that's freed goes onto its quick list without being coalesced
+ * first, coalescing is deferred until the block is flushed.
+ *
+ * Every quick list starts with a capacity of QUICK_LIST_MAX blocks, which then adapts to how
+ * the list is used.  If adding a block to a full quick list, the list doubles its capacity when
+ * at least half of its capacity was allocated from it since it last filled up.  Otherwise only
+ * the colder half of the list is flushed, returning the blocks freed longest ago to the main
+ * pool, and a list that wasn't allocated from at all also halves its capacity first.
  *
  * The quick lists are indexed by (size-MIN_BLOCK_SIZE)/ALIGN_SIZE, starting with blocks of the
  * minimum block size at index 0, blocks of size MIN_BLOCK_SIZE+ALIGN_SIZE at index 1, and so on.
@@ -193,20 +224,27 @@ int sf_errno;
  */
 
 #define NUM_QUICK_LISTS 12  /* Number of quick lists. */
-#define QUICK_LIST_MAX   5  /* Maximum number of blocks permitted on a single quick list. */
+#define QUICK_LIST_MAX   5  /* Initial capacity of every quick list. */
 
-struct {
+struct sf_quick_list {
     int length;             // Number of blocks currently in the list.
     struct sf_block *first; // Pointer to first block in the list.
-} sf_quick_lists[NUM_QUICK_LISTS];
+};
 
 /*
  * Free blocks are maintained in a set of circular, doubly linked lists, segregated by
- * size class.  The first list holds blocks of the minimum size M.  The second list holds
- * blocks of size (M, 2M].  The third list holds blocks whose size is in the interval (2M, 4M].
- * The fourth list holds blocks whose size is in the interval (4M, 8M], and so on.
- * This continues up to the interval (128M, 256M], and then the last list holds all blocks
- * of size greater than 256M.
+ * size class using a two-level (TLSF-style) index.  The first level splits sizes into
+ * power-of-two classes [2^k, 2^(k+1)), and the second level splits each of those classes
+ * into SL_COUNT lists of equal width.  Sizes below SMALL_BLOCK_SIZE all share first-level
+ * class 0, where each list holds exactly one size (a multiple of 16).
+ *
+ * Every arena (see below) has its own lists and bitmaps: a bit is set in the arena's fl_bitmap
+ * for every first-level class with a non-empty list, and a bit is set in its sl_bitmap[fl] for
+ * every non-empty list in that class.  Finding a non-empty list that's large enough for a request
+ * takes two bit scans, no list is ever walked.
+ *
+ * An arena stores its lists in an array of NUM_FREE_LISTS sentinels (free_list_heads), indexed by
+ * fl * SL_COUNT + sl.
  *
  * Each of the circular, doubly linked lists has a "dummy" block used as the list header.
  * This dummy block is always linked between the last and the first element of the list.
@@ -218,8 +256,131 @@ struct {
  * and deletion of nodes from the list.
  */
 
-#define NUM_FREE_LISTS 12
-struct sf_block sf_free_list_heads[NUM_FREE_LISTS];
+#define SL_LOG2          4                  /* log2 of the number of second-level lists. */
+#define SL_COUNT         (1 << SL_LOG2)     /* Second-level lists per first-level class. */
+#define SMALL_BLOCK_SIZE (SL_COUNT * 16)    /* Sizes below this are all in first-level class 0. */
+#define FL_COUNT         25                 /* First-level classes, enough for any 32-bit block size. */
+#define NUM_FREE_LISTS   (FL_COUNT * SL_COUNT)
+
+/*
+ * Arenas: the allocator runs up to SF_MAX_ARENAS independent heaps, each with its own quick lists,
+ * free lists, statistics and lock.  Each thread allocates from one arena (chosen round-robin when
+ * the thread first allocates, or by the CPU it's running on), while a block is always freed back
+ * to the arena it came from.  Every arena's heap lives in its own slice of the reserved range, see
+ * sf_heap_start().
+ */
+
+#ifndef SF_MAX_ARENAS
+#define SF_MAX_ARENAS 16
+#endif
+
+typedef enum {
+    SF_ARENA_ROUND_ROBIN,   /* Each thread is given the next arena when it first allocates. */
+    SF_ARENA_BY_CPU         /* Every allocation uses the arena of the CPU the thread is running on. */
+} sf_arena_mode;
+
+/*
+ * Sets the number of arenas and how threads are assigned to them.  This has to be done before the
+ * first allocation.  By default there is one arena per online CPU (up to SF_MAX_ARENAS), assigned
+ * round-robin.
+ *
+ * @return 0 on success.  If allocation has already started, count is not in [1, SF_MAX_ARENAS]
+ * or the mode is unknown, -1 is returned and sf_errno is set to EINVAL.
+ */
+int sf_set_arenas(int count, sf_arena_mode mode);
+
+/*
+ * @return The number of arenas threads are spread over.
+ */
+int sf_arena_count();
+
+/*
+ * Handlers for pthread_atfork(), which a program that forks while other threads may be allocating
+ * has to install (the preload library does):
+ *
+ *     pthread_atfork(sf_fork_prepare, sf_fork_parent, sf_fork_child);
+ *
+ * They hold every lock of the allocator across the fork, so the child starts with all of them free.
+ */
+void sf_fork_prepare();
+void sf_fork_parent();
+void sf_fork_child();
+
+/*
+ * Slabs: with SF_SLABS enabled (the default), requests of up to SLAB_MAX_SIZE bytes are served
+ * from page-sized slabs instead of the heap.  Every slab holds objects of a single size class
+ * (multiples of 16 bytes), with an occupancy bitmap in a descriptor at the start of the page and
+ * no header or footer per object, so an 8-byte request uses 16 bytes instead of MIN_BLOCK_SIZE.
+ * Since nothing is stored per object, the payload size of a slab object (in sf_utilization())
+ * is its size class.  Slab objects aren't blocks, so sf_fragmentation() doesn't include them.
+ * Build with -DSF_SLABS=0 to serve every request from the heap.
+ */
+
+#ifndef SF_SLABS
+#define SF_SLABS 1
+#endif
+
+#define SLAB_MAX_SIZE 256   /* Largest request served from a slab. */
+
+/*
+ * Large allocations: requests of at least the mmap threshold bytes (and any request too large for
+ * a block's 32-bit block_size) get a private mapping of their own instead of a heap block, so they
+ * never fragment a heap.  sf_free() unmaps them right away and sf_realloc() resizes them with
+ * mremap().  Such a chunk starts with two rows, the payload size and then a header holding the
+ * size of the whole mapping (a multiple of the page size) with IS_MMAPPED and the alloc bit set,
+ * both obfuscated like any other header.  The payload follows, so it's 16 bytes into a page.
+ * The live chunks are also kept in a registry, which sf_free() and sf_realloc() look a pointer up
+ * in before reading its header, so a chunk that's already been freed (and unmapped) is reported as
+ * an invalid pointer rather than faulting.
+ * Mapped chunks count in sf_fragmentation(), the whole mapping being their block size, and in
+ * sf_utilization(), where their mappings are part of the resident size.  They're in none of the
+ * per-arena statistics.
+ */
+
+#ifndef SF_MMAP_THRESHOLD
+#define SF_MMAP_THRESHOLD (128 * 1024)
+#endif
+
+/*
+ * Sets the size from which requests are served by their own mapping.  This can be changed at any
+ * time, chunks that already exist keep the kind they were allocated as.
+ */
+void sf_set_mmap_threshold(size_t threshold);
+
+/*
+ * @return The current mmap threshold, SF_MMAP_THRESHOLD unless sf_set_mmap_threshold() changed it.
+ */
+size_t sf_get_mmap_threshold();
+
+/*
+ * @return The total size of the mappings of every mapped chunk allocated right now.
+ */
+size_t sf_mmap_size();
+
+/*
+ * Huge pages: with SF_HUGE_PAGES enabled (-DSF_HUGE_PAGES=1), the reserved range is aligned to
+ * HUGE_PAGE_SZ and marked with madvise(MADV_HUGEPAGE), and every heap grows and shrinks by whole
+ * huge pages, its end always being on a huge page boundary.  With transparent huge pages enabled
+ * (in "always" or "madvise" mode), the kernel then backs the heaps with 2MB pages, so walking
+ * the free lists of a large heap takes far fewer TLB misses.  sf_trim() only releases whole huge
+ * pages, so it never splits one.  Heaps are 2MB at least, and sf_utilization() counts the whole
+ * huge pages.  Without transparent huge pages, the heaps simply grow in larger steps.
+ */
+
+#ifndef SF_HUGE_PAGES
+#define SF_HUGE_PAGES 0
+#endif
+
+#define HUGE_PAGE_SZ ((size_t)2 << 20)   /* Size of a huge page on x86-64 (and arm64 with 4KB pages). */
+
+/*
+ * All of the functions below are thread-safe.  Small blocks (quick list sizes) are served from
+ * per-thread caches without locking, everything else takes the lock of the arena involved.
+ * Freeing a larger block that belongs to another thread's arena doesn't lock that arena: the
+ * block is queued with a single compare-and-swap and released by the next thread to lock it.
+ * Mapped chunks belong to no arena, and only take the lock of their registry, briefly, to be
+ * added to it, looked up or removed.
+ */
 
 /*
  * This is your implementation of sf_malloc. It acquires uninitialized memory that
@@ -234,6 +395,54 @@ struct sf_block sf_free_list_heads[NUM_FREE_LISTS];
  */
 void *sf_malloc(size_t size);
 
+/*
+ * Allocates zeroed memory for an array of nmemb elements of size bytes each.
+ * Only the part of the block that may hold old data is cleared: memory that comes from pages
+ * the heap has just grown by (or from a new mapping) is already zero and isn't written at all.
+ *
+ * @return If nmemb * size is 0, then NULL is returned without setting sf_errno.
+ * If nmemb * size overflows, or the allocation is not successful, then NULL is returned and
+ * sf_errno is set to ENOMEM.  Otherwise a pointer to nmemb * size zero bytes is returned.
+ */
+void *sf_calloc(size_t nmemb, size_t size);
+
+/*
+ * Allocates size bytes whose address is a multiple of align, which has to be a power of two.
+ * Every payload is aligned to 16 bytes, so smaller alignments cost nothing extra.  Larger ones
+ * are served from a heap block whose payload happens to be aligned, or failing that, from one
+ * where it can be: the gap in front of the block is split off as a free block and so is the
+ * tail, so only the rounding of the payload size is wasted.  Small requests whose alignment
+ * allows it come from a slab instead.  Aligned requests are never mapped on their own, since
+ * mapped payloads are 16 bytes into a page.  The result is freed with sf_free() as usual.
+ *
+ * @return If size is 0, then NULL is returned without setting sf_errno.  If align isn't a power
+ * of two, NULL is returned and sf_errno is set to EINVAL.  If the allocation is not successful,
+ * NULL is returned and sf_errno is set to ENOMEM.
+ */
+void *sf_aligned_alloc(size_t align, size_t size);
+
+/*
+ * Same as sf_aligned_alloc(), with the interface of posix_memalign(): align also has to be a
+ * multiple of sizeof(void *), and the payload is stored in *memptr.  An invalid alignment is
+ * EINVAL whatever the size, 0 included.
+ *
+ * @return 0 on success (*memptr is NULL if size is 0), otherwise EINVAL or ENOMEM, which sf_errno
+ * is set to as well.  *memptr is left untouched on error.
+ */
+int sf_posix_memalign(void **memptr, size_t align, size_t size);
+
+/*
+ * Allocates n payloads of size bytes each, storing them in ptrs[0] to ptrs[n - 1].  This is the
+ * same as n calls to sf_malloc(), but the size is only looked at once, and whatever the thread
+ * cache can't provide is allocated under a single lock, carving the heap blocks side by side out
+ * of as few free blocks as possible.
+ *
+ * @return The number of payloads allocated, which are at the start of ptrs.  If it's less than n,
+ * memory ran out and sf_errno is set to ENOMEM.  If size is 0, nothing is allocated and 0 is
+ * returned without setting sf_errno.
+ */
+size_t sf_malloc_batch(size_t size, size_t n, void **ptrs);
+
 /*
  * Resizes the memory pointed to by ptr to size bytes.
  *
@@ -261,12 +470,85 @@ void *sf_realloc(void *ptr, size_t size);
  */
 void sf_free(void *ptr);
 
+/*
+ * Frees the n payloads in ptrs, in order, the same as n calls to sf_free().  Blocks that go back
+ * to the calling thread's own heap are coalesced and inserted into their lists under a single lock.
+ *
+ * If any pointer is invalid (including one that appears twice), the function calls abort().
+ */
+void sf_free_batch(void **ptrs, size_t n);
+
+/*
+ * Same as sf_free(), for a caller that knows the size the region was allocated with (the size
+ * passed to sf_malloc(), sf_calloc() or sf_aligned_alloc(), or the last sf_realloc()).  The pointer
+ * and the size are trusted: none of the checks sf_free() makes are done, which is all this saves,
+ * since the block size is still read from the header.  The size only goes into the statistics.
+ * Only DEBUG builds check them, and abort() if they're wrong.  NULL does nothing.
+ */
+void sf_free_sized(void *ptr, size_t size);
+
+/*
+ * @return The payload size of an allocated region (for a slab object, the size of its size class),
+ * or 0 if ptr isn't one.  Like sf_realloc(), nothing past that size is kept when it's resized.
+ */
+size_t sf_usable_size(void *ptr);
+
+/*
+ * Regions: for objects that are all freed at once, such as those of one request.  A region takes
+ * chunks of chunk_size bytes from the heap as ordinary allocations, and allocates objects inside
+ * them by moving a pointer forward, so an object has no header and costs no more than its size
+ * rounded up to 16.  Objects can't be freed or resized one by one; sf_region_reset() frees all of
+ * them at once in time proportional to the number of chunks, and keeps the chunks for the objects
+ * allocated next.  An object larger than a quarter of a chunk gets a chunk of its own, which the
+ * reset gives back to the heap.
+ *
+ * Unlike the functions above and below, a region must only be used by one thread at a time.
+ */
+
+/* Chunk size of a region created with a chunk_size of 0, small enough for chunks to be heap blocks. */
+#ifndef SF_REGION_CHUNK_SIZE
+#define SF_REGION_CHUNK_SIZE (64 * 1024)
+#endif
+
+typedef struct sf_region sf_region;
+
+/*
+ * Creates an empty region, the first chunk is only allocated by the first sf_region_alloc().
+ *
+ * @param chunk_size Bytes of objects each chunk holds, or 0 for SF_REGION_CHUNK_SIZE.
+ *
+ * @return The region, or NULL if memory ran out (sf_errno is set to ENOMEM).
+ */
+sf_region *sf_region_create(size_t chunk_size);
+
+/*
+ * Allocates size bytes, 16-byte aligned, in the region.
+ *
+ * @return The object, which stays valid until the region is reset or destroyed, or NULL if memory
+ * ran out (sf_errno is set to ENOMEM).  If size is 0, NULL is returned without setting sf_errno.
+ */
+void *sf_region_alloc(sf_region *region, size_t size);
+
+/*
+ * Frees every object of the region at once, keeping its chunks for the objects allocated next.
+ */
+void sf_region_reset(sf_region *region);
+
+/*
+ * Frees every object of the region, its chunks, and the region itself.  NULL does nothing.
+ */
+void sf_region_destroy(sf_region *region);
+
 /*
  * Get the current amount of internal fragmentation of the heap.
  *
  * @return  the current amount of internal fragmentation, defined to be the
  * ratio of the total amount of payload to the total size of allocated blocks.
  * If there are no allocated blocks, then the returned value should be 0.0.
+ *
+ * Both totals are kept up to date as blocks are allocated and freed, so this takes constant time.
+ * Like the aggregate payload below, blocks another thread allocated or freed through its thread
+ * cache are only included once that thread next takes the heap lock.
  */
 double sf_fragmentation();
 
@@ -279,11 +561,159 @@ double sf_fragmentation();
  * is the ratio of the maximum aggregate payload up to that time, divided
  * by the current heap size.  If the heap has not yet been initialized,
  * this function should return 0.0.
+ *
+ * Allocations served from a thread cache are only added to the aggregate payload when
+ * that thread next takes the heap lock, so the peak is sampled at those points.
+ *
+ * The heap size is the resident size: the heaps without the pages sf_trim() gave back to the OS,
+ * plus the mappings of the mapped chunks allocated right now.  Unmapping a chunk gives its pages
+ * back just like a trim, while the peak payload still includes it, so after either one the peak
+ * can be larger than the heap and the result can exceed 1.0.
  */
 double sf_utilization();
 
+/*
+ * Same as sf_fragmentation() and sf_utilization(), but for a single arena.  The functions above
+ * aggregate over all arenas (the peak payload being the peak of the total across all of them).
+ *
+ * @param arena Index of the arena, in [0, sf_arena_count()).
+ */
+double sf_arena_fragmentation(int arena);
+double sf_arena_utilization(int arena);
+
+/*
+ * Returns free heap memory to the OS.  In every arena, the heap is shrunk if its last block is
+ * free, leaving at least pad bytes of that block in place, and the pages inside every other free
+ * block large enough to contain whole pages are released with madvise(MADV_DONTNEED).  The blocks'
+ * headers, footers and links stay where they are, the pages are simply zero-filled the next time
+ * they're touched.  Thread caches and quick lists are left alone.  With SF_HUGE_PAGES, both only
+ * release whole huge pages.
+ *
+ * @param pad Number of free bytes to keep at the end of each heap.
+ *
+ * @return The number of bytes given back to the OS.
+ */
+size_t sf_trim(size_t pad);
+
+/*
+ * Heap profiler (sfprof.c): while it's active, about one allocation every interval bytes is
+ * sampled (the distance between samples is drawn from an exponential distribution with that
+ * mean), and its backtrace is kept until the payload is freed.  A dump lists the live samples
+ * grouped by backtrace in the heap profile format of gperftools (heap_v2), which pprof reads and
+ * scales back up to estimated totals:
+ *
+ *     pprof --text ./program heap.prof
+ *
+ * Only live samples are kept, so the cumulative allocation columns are always zero.  While the
+ * profiler is off, the only cost to sf_malloc(), sf_realloc() and sf_free() is one branch each.
+ */
+
+/*
+ * Starts sampling, about once every interval bytes allocated (512KB is a reasonable default).
+ *
+ * @return 0 on success.  If interval is 0, -1 is returned and sf_errno is set to EINVAL, if the
+ * sample table can't be mapped, -1 is returned and sf_errno is set to ENOMEM.
+ */
+int sf_prof_start(size_t interval);
+
+/*
+ * Stops sampling and discards the live samples.
+ */
+void sf_prof_stop();
+
+/*
+ * Writes a heap profile of the live samples to path.
+ *
+ * @return 0 on success, -1 if the file can't be written (errno is set).
+ */
+int sf_prof_dump(const char *path);
+
+/*
+ * Installs a handler that writes a heap profile to path whenever signal signum is received
+ * (e.g. SIGUSR1).  Samples that are being added or removed at that moment may be left out.
+ *
+ * @return 0 on success, -1 on error (errno is set).
+ */
+int sf_prof_dump_on_signal(int signum, const char *path);
+
+/* Used by sfmm.c: whether the profiler is active, and the hooks called when it is. */
+extern int sf_prof_active;
+void sf_prof_malloc(void *pp, size_t size);
+void sf_prof_realloc(void *old_pp, void *new_pp, size_t size);
+void sf_prof_free(void *pp);
+void sf_prof_fork_lock();
+void sf_prof_fork_unlock();
 
-/* sfutil.c: Helper functions already created for this assignment. */
+/*
+ * Placement policies used to choose a free block from the main free lists.
+ *
+ *   SF_FIT_GOOD     Round the request up to the next list boundary and take the head of the first
+ *                   non-empty list from there.  Constant time, but may skip a block that would fit.
+ *   SF_FIT_FIRST    Take the first block that fits in the request's own list, otherwise the head of
+ *                   the next non-empty list.
+ *   SF_FIT_BEST     Take the smallest block that fits, searching the request's own list and then the
+ *                   next non-empty list.
+ *   SF_FIT_ADDRESS  Keep every list sorted by address and use first fit, so the lowest-addressed block
+ *                   that fits is taken.  Insertion walks the list.
+ *   SF_FIT_NEXT     First fit, but each list is searched starting from where the previous search in
+ *                   that list stopped (a roving pointer per list).
+ *
+ * The build-time default can be changed by defining SF_DEFAULT_POLICY.
+ */
+typedef enum {
+    SF_FIT_GOOD,
+    SF_FIT_FIRST,
+    SF_FIT_BEST,
+    SF_FIT_ADDRESS,
+    SF_FIT_NEXT
+} sf_fit_policy;
+
+#ifndef SF_DEFAULT_POLICY
+#define SF_DEFAULT_POLICY SF_FIT_GOOD
+#endif
+
+/*
+ * Selects the placement policy.  This has to be done before the first allocation, since the free
+ * lists are laid out differently under some policies.
+ *
+ * @param policy The policy to use.
+ *
+ * @return 0 on success.  If the heap has already been initialized or the policy is unknown,
+ * -1 is returned and sf_errno is set to EINVAL.
+ */
+int sf_set_policy(sf_fit_policy policy);
+
+/*
+ * @return The placement policy currently in use.
+ */
+sf_fit_policy sf_get_policy();
+
+/*
+ * @return The name of the given policy ("good", "first", "best", "address" or "next").
+ */
+const char *sf_policy_name(sf_fit_policy policy);
+
+
+/* sfutil.c: Heap provider. */
+
+/*
+ * Reserves the virtual address range the heap grows into. This runs automatically before
+ * main(), or when the heap first grows if that's earlier, so it only needs to be called again to
+ * start over after sf_mem_fini().  It's safe to call from several threads at once.
+ */
+void sf_mem_init();
+
+/*
+ * Releases the heap range. Every pointer returned by the allocator becomes invalid.
+ */
+void sf_mem_fini();
+
+/*
+ * Number of times sf_mem_fini() has released the heap range.  The allocator compares it with the
+ * value it last saw before using an arena or a thread cache, and empties them if it changed, so
+ * they never hand out blocks of the released range.  Only sf_mem_fini() changes it.
+ */
+extern unsigned long sf_mem_generation;
 
 /*
  * @return The starting address of the heap for your allocator.
@@ -305,6 +735,14 @@ void *sf_mem_end();
  */
 void *sf_mem_grow();
 
+/*
+ * Same as sf_mem_grow(), but adds npages pages to the end of the heap in one step.
+ *
+ * @return On success, a pointer to the start of the first additional page.
+ * On error (npages is 0 or the reserved range is exhausted), NULL is returned.
+ */
+void *sf_mem_grow_n(size_t npages);
+
 /* The size of a page of memory returned by sf_mem_grow(). */
 #define PAGE_SZ ((size_t)4096)
 
@@ -315,6 +753,52 @@ void *sf_mem_grow();
  */
 sf_header sf_magic();
 
+/*
+ * How headers and footers are obfuscated, chosen at build time with -DSF_OBF_MODE=...
+ *   0  Not at all, MAGIC is ignored and decoding costs nothing.
+ *   1  XOR with MAGIC, read from sf_magic() once (when the first heap is initialized) and kept
+ *      in a static, so decoding is a single XOR.
+ *   2  XOR with MAGIC, calling sf_magic() on every access, so it can't be cached anywhere.
+ */
+#ifndef SF_OBF_MODE
+#define SF_OBF_MODE 1
+#endif
+
+/*
+ * Each arena's heap is its own slice of the reserved range.  These are the per-heap versions of
+ * sf_mem_start(), sf_mem_end() and sf_mem_grow_n(), which refer to heap 0.
+ *
+ * @param heap Index of the heap, in [0, SF_MAX_ARENAS).
+ */
+void *sf_heap_start(int heap);
+void *sf_heap_end(int heap);
+void *sf_heap_grow_n(int heap, size_t npages);
+
+/*
+ * Removes npages pages from the end of a heap.  Their contents are discarded and they're made
+ * inaccessible again, like the rest of the heap's slice.
+ *
+ * @return On success, the new end of the heap.  On error (npages is 0 or more than the heap
+ * has), NULL is returned.
+ */
+void *sf_heap_shrink_n(int heap, size_t npages);
+
+/*
+ * @return The index of the heap whose slice contains ptr, or -1 if ptr isn't in the reserved range.
+ */
+int sf_heap_index(const void *ptr);
+
+/*
+ * Slab pages of each heap come from a separate slice, after all of the heaps.  These work like
+ * the functions above, except that sf_slab_index() returns -1 for anything outside the slab slices.
+ *
+ * @param heap Index of the heap the slab slice belongs to, in [0, SF_MAX_ARENAS).
+ */
+void *sf_slab_start(int heap);
+void *sf_slab_end(int heap);
+void *sf_slab_grow_n(int heap, size_t npages);
+int sf_slab_index(const void *ptr);
+
 #define MAGIC (sf_magic())
 
 /*
@@ -330,7 +814,8 @@ sf_header sf_magic();
 void sf_set_magic(sf_header magic);
 
 /*
- * Display the contents of the heap in a human-readable form.
+ * Display the contents of the heap in a human-readable form (implemented in sfmm.c).
+ * Every arena that has been used is shown.
  */
 void sf_show_block(sf_block *bp);
 void sf_show_blocks();
@@ -340,4 +825,8 @@ void sf_show_quick_list(int index);
 void sf_show_quick_lists();
 void sf_show_heap();
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
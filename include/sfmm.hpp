@@ -0,0 +1,240 @@
+#ifndef SFMM_HPP
+#define SFMM_HPP
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include "sfmm.h"
+
+/*
+ * C++ interface to the allocator (C++17).
+ *
+ *   sfmm::allocator<T>         An allocator for standard containers, e.g. std::vector<int, sfmm::allocator<int>>.
+ *   sfmm::memory_resource      A std::pmr::memory_resource, for std::pmr containers and pools built on it.
+ *                              sfmm::get_memory_resource() returns a shared instance.
+ *
+ * Both know the size of what they free, so they go through sf_free_sized(), which trusts the size and skips
+ * the checks sf_free() makes.  Alignments above 16 bytes go through sf_aligned_alloc().
+ *
+ * Defining SFMM_REPLACE_NEW before including this header in exactly one translation unit of a program also
+ * replaces the global operator new and delete (every form, including sized and aligned ones) with the allocator.
+ * The sized forms of delete use sf_free_sized() as well.
+ */
+
+namespace sfmm {
+
+namespace detail {
+
+/*
+ * Allocates size bytes aligned to align (a power of two), or returns nullptr.  Zero-sized requests get a payload
+ * of their own as well, since C++ needs a unique pointer for them.
+ */
+inline void *try_allocate(std::size_t size, std::size_t align) noexcept {
+    if(size == 0) size = 1;
+    return align <= 16 ? sf_malloc(size) : sf_aligned_alloc(align, size);
+}
+
+/*
+ * Same as try_allocate(), but throws std::bad_alloc instead of returning nullptr.
+ */
+inline void *allocate(std::size_t size, std::size_t align) {
+    void *pp = try_allocate(size, align);
+    if(!pp) throw std::bad_alloc();
+    return pp;
+}
+
+/*
+ * Frees what allocate() returned for the same size.
+ */
+inline void deallocate(void *pp, std::size_t size) noexcept {
+    sf_free_sized(pp, size ? size : 1);
+}
+
+}
+
+template<class T>
+class allocator {
+public:
+    using value_type = T;
+    using is_always_equal = std::true_type;
+
+    allocator() noexcept = default;
+
+    template<class U>
+    allocator(const allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        if(n > std::numeric_limits<std::size_t>::max() / sizeof(T)) throw std::bad_array_new_length();
+        return static_cast<T *>(detail::allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *pp, std::size_t n) noexcept {
+        detail::deallocate(pp, n * sizeof(T));
+    }
+};
+
+// Every allocator frees what any other one allocated
+template<class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+    return true;
+}
+
+template<class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+    return false;
+}
+
+class memory_resource : public std::pmr::memory_resource {
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        return detail::allocate(bytes, align);
+    }
+
+    void do_deallocate(void *pp, std::size_t bytes, std::size_t) override {
+        detail::deallocate(pp, bytes);
+    }
+
+    // Any instance frees what any other one allocated
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return dynamic_cast<const memory_resource *>(&other) != nullptr;
+    }
+};
+
+/*
+ * @return A memory_resource shared by the whole program, e.g. for std::pmr::set_default_resource().
+ */
+inline memory_resource *get_memory_resource() noexcept {
+    static memory_resource resource;
+    return &resource;
+}
+
+}
+
+#ifdef SFMM_REPLACE_NEW
+
+namespace sfmm {
+
+namespace detail {
+
+/*
+ * The loop every throwing operator new runs: retry after the new handler, throw once there's none.
+ */
+inline void *operator_new(std::size_t size, std::size_t align) {
+    for(;;) {
+        void *pp = try_allocate(size, align);
+        if(pp) return pp;
+        std::new_handler handler = std::get_new_handler();
+        if(!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+inline void *operator_new_nothrow(std::size_t size, std::size_t align) noexcept {
+    try {
+        return operator_new(size, align);
+    } catch(...) {
+        return nullptr;
+    }
+}
+
+/*
+ * Unsized delete, nullptr does nothing.
+ */
+inline void operator_delete(void *pp) noexcept {
+    if(pp) sf_free(pp);
+}
+
+/*
+ * Sized delete, the size is the one given to operator new.
+ */
+inline void operator_delete(void *pp, std::size_t size) noexcept {
+    if(pp) deallocate(pp, size);
+}
+
+}
+
+}
+
+void *operator new(std::size_t size) {
+    return sfmm::detail::operator_new(size, 16);
+}
+
+void *operator new[](std::size_t size) {
+    return sfmm::detail::operator_new(size, 16);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return sfmm::detail::operator_new_nothrow(size, 16);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return sfmm::detail::operator_new_nothrow(size, 16);
+}
+
+void *operator new(std::size_t size, std::align_val_t align) {
+    return sfmm::detail::operator_new(size, static_cast<std::size_t>(align));
+}
+
+void *operator new[](std::size_t size, std::align_val_t align) {
+    return sfmm::detail::operator_new(size, static_cast<std::size_t>(align));
+}
+
+void *operator new(std::size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+    return sfmm::detail::operator_new_nothrow(size, static_cast<std::size_t>(align));
+}
+
+void *operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+    return sfmm::detail::operator_new_nothrow(size, static_cast<std::size_t>(align));
+}
+
+void operator delete(void *pp) noexcept {
+    sfmm::detail::operator_delete(pp);
+}
+
+void operator delete[](void *pp) noexcept {
+    sfmm::detail::operator_delete(pp);
+}
+
+void operator delete(void *pp, std::size_t size) noexcept {
+    sfmm::detail::operator_delete(pp, size);
+}
+
+void operator delete[](void *pp, std::size_t size) noexcept {
+    sfmm::detail::operator_delete(pp, size);
+}
+
+void operator delete(void *pp, const std::nothrow_t &) noexcept {
+    sfmm::detail::operator_delete(pp);
+}
+
+void operator delete[](void *pp, const std::nothrow_t &) noexcept {
+    sfmm::detail::operator_delete(pp);
+}
+
+void operator delete(void *pp, std::align_val_t) noexcept {
+    sfmm::detail::operator_delete(pp);
+}
+
+void operator delete[](void *pp, std::align_val_t) noexcept {
+    sfmm::detail::operator_delete(pp);
+}
+
+void operator delete(void *pp, std::size_t size, std::align_val_t) noexcept {
+    sfmm::detail::operator_delete(pp, size);
+}
+
+void operator delete[](void *pp, std::size_t size, std::align_val_t) noexcept {
+    sfmm::detail::operator_delete(pp, size);
+}
+
+void operator delete(void *pp, std::align_val_t, const std::nothrow_t &) noexcept {
+    sfmm::detail::operator_delete(pp);
+}
+
+void operator delete[](void *pp, std::align_val_t, const std::nothrow_t &) noexcept {
+    sfmm::detail::operator_delete(pp);
+}
+
+#endif
+
+#endif
@@ -1,6 +1,40 @@
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "sfmm.h"
 
+// Size well above the mmap threshold, so it gets a mapped chunk
+#define MAPPED_SIZE (4 * SF_MMAP_THRESHOLD)
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    if(!ok) failures++;
+}
+
+// Runs test in a child process, and returns whether it was killed by SIGABRT
+static int aborts(void (*test)()) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+        test();
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    if(pid < 0 || waitpid(pid, &status, 0) < 0) return 0;
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+// A mapped chunk is unmapped by the first sf_free(), so the second one must not read its header
+static void double_free_mapped() {
+    void *x = sf_malloc(MAPPED_SIZE);
+    sf_free(x);
+    sf_free(x);
+}
 
 // This main file is what you can use to test out the functions given in sfmm.c
 // Below is leftover code from me testing while doing the assignment
@@ -22,5 +56,23 @@ int main(int argc, char const *argv[]) {
 	void *x = sf_malloc(16316);
     (void) x;
 
-    return EXIT_SUCCESS;
+    // Freed mapped chunks are invalid pointers, not faults
+    check(aborts(double_free_mapped), "double free of a mapped chunk aborts");
+    void *y = sf_malloc(MAPPED_SIZE);
+    sf_free(y);
+    sf_errno = 0;
+    check(sf_realloc(y, 2 * MAPPED_SIZE) == NULL && sf_errno == EINVAL, "realloc of a freed mapped chunk is EINVAL");
+
+    // Nothing cached before sf_mem_fini() is handed out after the heaps start over
+    void *small = sf_malloc(24);
+    sf_free(small);
+    sf_mem_fini();
+    sf_mem_init();
+    small = sf_malloc(24);
+    check(small && (sf_slab_index(small) >= 0 || sf_heap_index(small) >= 0),
+          "small allocation after sf_mem_fini() is in the new range");
+    memset(small, 0, 24);
+    sf_free(small);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }
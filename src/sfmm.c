@@ -1,24 +1,78 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "sfmm.h"
 
 /* Minimum block size */
 #define MIN_BLOCK_SIZE 32
 /* One memory row is 8 bytes */
 #define MROW 8
-#define HEAP_SIZE() (sf_mem_end() - sf_mem_start()) /* Return the heap size calculated from difference in starting and end address */
+#define ARENA_INDEX(arena) ((int)((arena) - arenas)) /* Index of the arena, which is also the index of its heap */
+#define HEAP_START(arena) ((char *)sf_heap_start(ARENA_INDEX(arena))) /* Start of the arena's heap */
+#define HEAP_END(arena) ((char *)sf_heap_end(ARENA_INDEX(arena))) /* End of the arena's heap */
+#define HEAP_SIZE(arena) (HEAP_END(arena) - HEAP_START(arena)) /* Return the heap size calculated from difference in starting and end address */
+#define ARENA_OF(ptr) (arenas + sf_heap_index(ptr)) /* Arena a (valid) block or payload pointer belongs to */
 #define QL_MAX_SIZE 224 // 32 + 16 * 12 = 224 bytes size for the last quick list (EXCLUSIVE)
 #define QL_INDEX(size) (size-32)/16 /* Return calculated quick list index based on size passed in (note: size should always be a multiple of 16 */
+#ifndef TCACHE_MAX
+#define TCACHE_MAX 16   // Maximum number of blocks in one thread cache bin, 0 bypasses the block caches (see TCACHED)
+#endif
+#define TCACHE_BATCH 8  // Number of blocks moved between a thread cache and the heap at a time
+// Whether blocks of block_size go through the thread cache, rather than straight to the arena's quick lists
+#define TCACHED(block_size) (TCACHE_MAX > 0 && (block_size) < QL_MAX_SIZE)
+#define QL_CAPACITY_MIN 2   // Bounds of the adaptive capacity of a quick list, which starts at QUICK_LIST_MAX
+#define QL_CAPACITY_MAX 64
+#define SLAB_CLASSES (SLAB_MAX_SIZE / 16) // Number of slab size classes (multiples of 16 up to SLAB_MAX_SIZE)
+#define SLAB_CLASS(size) (((size) - 1) / 16) /* Slab size class of a request of 1 to SLAB_MAX_SIZE bytes */
+#define SLAB_HEADER_SIZE 64 // Space for the descriptor at the start of every slab page (a multiple of 16)
+#define SLAB_GROW_PAGES 16  // Number of slab pages committed at a time
+#define SLAB_OF(ptr) ((struct sf_slab *)((size_t)(ptr) & ~(PAGE_SZ - 1))) /* Slab a slab object is in */
+#define SLAB_OBJ(slab, i) ((char *)(slab) + SLAB_HEADER_SIZE + (size_t)(i) * (slab) -> obj_size) /* Object i of a slab */
+#define SLAB_AREA_SIZE(arena) ((char *)sf_slab_end(ARENA_INDEX(arena)) - (char *)sf_slab_start(ARENA_INDEX(arena)))
+#define MMAP_OVERHEAD (2*MROW) // Payload size and header rows in front of a mapped chunk's payload
+#define MMAP_SIZE(pl_size) (((pl_size) + MMAP_OVERHEAD + PAGE_SZ - 1) & ~(PAGE_SZ - 1)) /* Mapping size for a payload */
+#define MMAP_BASE(pp) ((sf_header *)((char *)(pp) - MMAP_OVERHEAD)) /* Start of the mapping of a mapped chunk */
+#define MAX_BLOCK_SIZE 0xFFFFFFF0 // Largest size the 28 bit block_size field (4 LSB's implicitly 0) can hold
+#if SF_HUGE_PAGES
+#define HEAP_UNIT HUGE_PAGE_SZ  // Heaps grow and shrink by whole huge pages, and trimming never splits one
+#else
+#define HEAP_UNIT PAGE_SZ       // Granularity of heap growth, shrinking and trimming
+#endif
 #define PROLOGUE_SIZE 32
 #define EPILOGUE_SIZE 8
 // Construct the size variable based on the parameters passed in
 #define PACK(pl_size, block_size, in_ql, alloc) (size_t) (((size_t)pl_size << 32) | (block_size) | (in_ql << 1) | (alloc))
 #define GET_PL_SIZE(header) (header >> 32)
 #define GET_BLOCK_SIZE(header) (((size_t)header) & ~0xFFFFFFFF0000000F)
-// Obfuscate macro (simply XOR)
+#define PREV_ALLOC(header) ((header) & PREV_BLOCK_ALLOCATED) /* Whether the block before this one is allocated */
+#if SF_FOOTER_ELISION
+#define BLOCK_OVERHEAD MROW      // Allocated blocks only have a header
+#else
+#define BLOCK_OVERHEAD (2*MROW)  // Header and footer
+#endif
+// Whether the heap profiler is active (see sfprof.c), expected not to be so it's one predictable branch
+#define PROFILING __builtin_expect(__atomic_load_n(&sf_prof_active, __ATOMIC_RELAXED), 0)
+// Whether the calling thread's cache, or the arenas, still hold blocks of a heap range sf_mem_fini() released since,
+// expected not to be so it's one predictable branch (see tcache_reset() and reset_arenas())
+#define TCACHE_STALE __builtin_expect(tcache.generation != __atomic_load_n(&sf_mem_generation, __ATOMIC_RELAXED), 0)
+#define ARENAS_STALE __builtin_expect(__atomic_load_n(&arenas_generation, __ATOMIC_ACQUIRE) != \
+                                      __atomic_load_n(&sf_mem_generation, __ATOMIC_RELAXED), 0)
+// Index of the most significant set bit (floor of log2), size must be nonzero
+#define FLS(size) (63 - __builtin_clzl((size_t)(size)))
+// Obfuscate macro (simply XOR), specialized for the obfuscation mode (see sfmm.h)
+#if SF_OBF_MODE == 0
+#define OBF(value) ((sf_header)(value))
+#elif SF_OBF_MODE == 1
+#define OBF(value) ((value) ^ obf_key)
+#else
 #define OBF(value) ((value) ^ MAGIC)
+#endif
 
 // Macros to grab next and previous blocks based on pointer passed in
 #define NEXT_BLOCK(block) (sf_block *) ((char *) block + GET_BLOCK_SIZE(OBF(block -> header)))
@@ -27,140 +81,1632 @@
 // Define footer macro for a given block pointer (sf_block *)
 #define FOOTER(block) (sf_footer *) ((char *) block + GET_BLOCK_SIZE(OBF(block -> header)) - MROW) 
 
-sf_block* split_malloc_block(sf_block* block, size_t block_size, size_t pl_size);
+typedef struct sf_arena sf_arena;
+struct sf_slab_bin;
+
+sf_block* split_malloc_block(sf_arena *arena, sf_block* block, size_t block_size, size_t pl_size);
+sf_block *grow_malloc_block(sf_arena *arena, sf_block *block, size_t block_size, size_t pl_size);
+size_t calc_block_size(size_t pl_size);
 void *create_malloc_block(sf_block* free_block, size_t pl_size);
 int validate_pp(void * pp);
-void unlink_block(sf_block *block);
-sf_block* popQL(int index);
-sf_block* find_fit(size_t block_size);
-int initialize_heap();
-int extend_heap();
+void unlink_block(sf_arena *arena, sf_block *block);
+sf_block* popQL(sf_arena *arena, int index);
+sf_block* find_fit(sf_arena *arena, size_t block_size);
+int find_nonempty_list(sf_arena *arena, int index);
+sf_block *first_fit_in_list(sf_arena *arena, int index, size_t block_size);
+sf_block *best_fit_in_list(sf_arena *arena, int index, size_t block_size);
+sf_block *next_fit_in_list(sf_arena *arena, int index, size_t block_size);
+int initialize_heap(sf_arena *arena);
+void load_obf_key();
+sf_block *extend_heap(sf_arena *arena, size_t npages);
+size_t pages_needed(sf_arena *arena, size_t block_size);
 int get_ml_index(size_t size);
 void *create_free_block(size_t block_size, char *start_addr);
-void initialize_free_lists();
-void insert_ml(sf_block* free_block);
-void insert_ql(sf_block * free_block);
-void flush_ql(int index);
-sf_block *coalesce(sf_block* free_block);
-sf_block* split_free_block(sf_block* free_block, size_t block_size);
-
-// Variables to track statistics for sf_util
+void set_header(sf_block *block, sf_header header);
+void set_prev_alloc(sf_block *block, int prev_alloc);
+void flip_header_bits(sf_block *block, sf_header bits);
+void initialize_free_lists(sf_arena *arena);
+void insert_ml(sf_arena *arena, sf_block* free_block);
+void insert_ql(sf_arena *arena, sf_block * free_block);
+void flush_ql(sf_arena *arena, int index, int keep);
+sf_block *coalesce(sf_arena *arena, sf_block* free_block);
+int remove_ml(sf_arena *arena, sf_block *free_block);
+void detach_ml(sf_arena *arena, sf_block *free_block, const char *which);
+sf_block* split_free_block(sf_arena *arena, sf_block* free_block, size_t block_size);
+sf_block *take_block(sf_arena *arena, size_t block_size);
+void *heap_alloc(size_t size, char **fresh);
+void *calloc_payload(size_t size);
+void clear_payload(char *pp, size_t size, char *fresh);
+void mark_used(sf_arena *arena, char *end);
+void *aligned_payload(size_t align, size_t size);
+sf_block *take_aligned_block(sf_arena *arena, size_t block_size, size_t align);
+sf_block *aligned_fit(sf_arena *arena, size_t block_size, size_t align);
+size_t align_gap(sf_block *block, size_t align);
+void release_block(sf_arena *arena, sf_block *block);
+void free_heap_block(sf_block *block, size_t block_size, size_t pl_size);
+size_t malloc_batch(size_t size, size_t n, void **ptrs);
+size_t slab_alloc_batch(size_t size, size_t n, void **ptrs);
+size_t heap_alloc_batch(size_t size, size_t n, void **ptrs);
+sf_block *take_run(sf_arena *arena, size_t block_size, size_t count);
+size_t carve_blocks(sf_arena *arena, sf_block *run, size_t block_size, size_t pl_size, size_t count, void **ptrs);
+void release_batch(sf_arena *arena, sf_block *list);
+sf_block *tcache_pop(int index, size_t block_size);
+void tcache_push(sf_block *block);
+void tcache_refill(int index, size_t block_size);
+void tcache_drain(struct sf_quick_list *bin, int count);
+void tcache_register();
+void tcache_reset();
+void reset_arenas();
+void flush_delta(sf_arena *arena);
+void flush_all_deltas();
+void tcache_count_block(sf_block *block, long pl_size, long block_size);
+void update_blocks(sf_arena *arena, long pl_size, long block_size);
+int heaps_empty();
+int arena_used(sf_arena *arena);
+sf_arena *get_arena();
+void lock_arena(sf_arena *arena);
+void unlock_arena(sf_arena *arena);
+void push_remote_free(sf_arena *arena, sf_block *block);
+void drain_remote_frees(sf_arena *arena);
+void *slab_alloc(size_t size);
+void slab_free(void *pp);
+void slab_refill(int cls);
+void slab_drain(struct sf_slab_bin *bin, int count);
+void *slab_take(sf_arena *arena, int cls);
+void slab_release(sf_arena *arena, void *obj);
+struct sf_slab *new_slab(sf_arena *arena, int cls);
+void link_slab(sf_arena *arena, struct sf_slab *slab);
+void unlink_slab(sf_arena *arena, struct sf_slab *slab);
+void push_remote_slab_free(sf_arena *arena, void *obj);
+int validate_slab_pp(void *pp, int index);
+void update_total_pl(long size);
+int wants_mmap(size_t size);
+void *mmap_alloc(size_t size);
+void mmap_free(void *pp);
+void *mmap_realloc(void *pp, size_t rsize);
+void mmap_account(long pl_size, long map_size);
+int validate_mmap_pp(void *pp);
+int mmap_register(sf_header *base, sf_header *old);
+void mmap_unregister(sf_header *base);
+int mmap_registered(sf_header *base);
+size_t mmap_slot(sf_header *base);
+int mmap_table_grow();
+void *realloc_move(void *pp, size_t rsize, size_t old_size);
+void *malloc_payload(size_t size);
+size_t trim_heap(sf_arena *arena, size_t pad);
+size_t trim_block(sf_arena *arena, sf_block *block);
+
+__thread int sf_errno;
+
+// Copy of MAGIC for SF_OBF_MODE 1, see load_obf_key()
+static sf_header obf_key;
+static pthread_once_t obf_once = PTHREAD_ONCE_INIT;
+
+// Placement policy, fixed once the heap is initialized
+sf_fit_policy fit_policy = SF_DEFAULT_POLICY;
+
+/*
+ * An arena is one independent heap, with its own lists, statistics and lock (see sfmm.h).
+ * Its heap is the slice of the reserved range with the same index as the arena.
+ */
+struct sf_arena {
+    pthread_mutex_t lock;                           // Protects everything below and the arena's heap
+    struct sf_quick_list quick_lists[NUM_QUICK_LISTS];
+    int ql_capacity[NUM_QUICK_LISTS];               // Current capacity of each quick list, see insert_ql()
+    int ql_pops[NUM_QUICK_LISTS];                   // Blocks taken from each quick list since it last overflowed
+    struct sf_block free_list_heads[NUM_FREE_LISTS];
+    uint32_t fl_bitmap;                             // Non-empty first-level classes
+    uint32_t sl_bitmap[FL_COUNT];                   // Non-empty lists within each first-level class
+    sf_block *rovers[NUM_FREE_LISTS];               // Roving pointers for SF_FIT_NEXT, where the next search
+                                                    // of each list starts (the sentinel if at the beginning)
+    long running_pl;                                // Current payload total (signed, see update_pl())
+    long max_pl;                                    // Peak payload total
+    long alloc_pl;                                  // Payload and size of the allocated blocks in the heap, for
+    long alloc_size;                                // sf_arena_fragmentation() (see update_blocks())
+    sf_block *remote_frees;                         // Blocks freed by other threads, not yet released (lock-free,
+                                                    // see push_remote_free())
+    struct sf_slab *slabs[SLAB_CLASSES];            // Slabs with at least one free object, per size class
+    struct sf_slab *empty_slabs;                    // Unused slab pages, not assigned to a size class
+    void *remote_slab_frees;                        // Slab objects freed by other threads (like remote_frees)
+    size_t trimmed;                                 // Bytes inside free blocks released by sf_trim(), see trim_block()
+    char *fresh;                                    // Start of the part of the heap no block has been taken from
+                                                    // yet, so it's still zero (see sf_calloc())
+};
+
+/*
+ * Descriptor at the start of every slab page, followed by the objects (see slab_alloc())
+ */
+struct sf_slab {
+    struct sf_slab *next;                           // Links in the arena's list of slabs of this size class
+    struct sf_slab *prev;                           // (only next is used in the list of empty slabs)
+    uint32_t obj_size;                              // Size of every object in the slab
+    uint16_t capacity;                              // Number of objects
+    uint16_t used;                                  // Number of objects in use (including thread caches)
+    uint64_t bitmap[4];                             // Bit set for every object in use, and every bit past capacity
+};
+
+sf_arena arenas[SF_MAX_ARENAS] = {
+    [0 ... SF_MAX_ARENAS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+// Number of arenas threads are spread over, and how they're assigned (set once, see init_arenas())
+int arena_count = 0;
+sf_arena_mode arena_mode = SF_ARENA_ROUND_ROBIN;
+pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+// Round-robin counter, and the arena the calling thread was given
+unsigned int next_arena = 0;
+__thread sf_arena *thread_arena;
+// Value of sf_mem_generation the arenas were last reset for
+unsigned long arenas_generation = 0;
+
+// Thread cache bin of slab objects, linked through their first word
+struct sf_slab_bin {
+    int length;
+    void *first;
+};
+
+// Statistics of one arena a thread changed without the arena's lock, not yet added to it (see flush_delta())
+struct sf_delta {
+    long pl;                                    // Payload allocated minus payload freed (blocks and slab objects)
+    long block_pl;                              // The same for heap blocks only
+    long block_size;                            // Size of the heap blocks allocated minus the size of those freed
+};
+
+// Thread caches, see tcache_pop()
+struct sf_tcache {
+    struct sf_quick_list bins[NUM_QUICK_LISTS]; // Cached blocks, indexed like the quick lists
+    struct sf_slab_bin slab_bins[SLAB_CLASSES]; // Cached slab objects, per size class
+    struct sf_delta deltas[SF_MAX_ARENAS];      // Statistics deltas per arena
+    int registered;                             // Whether tcache_destroy() will run on thread exit
+    unsigned long generation;                   // Value of sf_mem_generation the cache was filled in
+};
+__thread struct sf_tcache tcache;
+pthread_key_t tcache_key;
+pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+// Variables to track statistics for sf_util across all arenas (each arena also has its own)
 // Current running total
-size_t running_pl = 0;
+long running_pl = 0;
 // Max total
-size_t max_pl = 0;
+long max_pl = 0;
+// Payload and size of the allocated blocks in every heap, for sf_fragmentation()
+long alloc_pl = 0;
+long alloc_size = 0;
 /**
-* @brief Simple helper function to update max and running total
+* @brief Simple helper function to update max and running total, of the arena and of all arenas
 * @param size, increment/decrement to add/subtract from running_pl 
+* @note Must be called with the arena's lock held. The totals across arenas are updated atomically, since
+* several arena locks can be held at once. They're signed because a block allocated by one thread and freed by
+* another can be subtracted before it was added, which would otherwise wrap around and become the peak.
 */
-void update_pl(size_t size){
-    running_pl += size;
-    if(running_pl > max_pl) max_pl = running_pl;
+void update_pl(sf_arena *arena, long size){
+    arena -> running_pl += size;
+    if(arena -> running_pl > arena -> max_pl) arena -> max_pl = arena -> running_pl;
+    update_total_pl(size);
 }
 
+/**
+ * @brief Adds to the payload and size totals of the arena's allocated blocks (quick list and thread cache blocks
+ * don't count), and to those of all arenas
+ * @param pl_size, change in payload, which update_pl() has to be given as well
+ * @param block_size, change in block size
+ * @note Must be called with the arena's lock held, the totals across arenas are updated atomically like running_pl
+ */
+void update_blocks(sf_arena *arena, long pl_size, long block_size) {
+    arena -> alloc_pl += pl_size;
+    arena -> alloc_size += block_size;
+    __atomic_add_fetch(&alloc_pl, pl_size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_size, block_size, __ATOMIC_RELAXED);
+}
 
-void *sf_malloc(size_t size) {
-    // Check if size is 0, return NULL in this case
-    if (size == 0)
+/**
+ * @brief Updates the running and max totals across all arenas only, no lock needed
+ * @param size, increment/decrement to add/subtract from running_pl
+ */
+void update_total_pl(long size) {
+    long total = __atomic_add_fetch(&running_pl, size, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&max_pl, __ATOMIC_RELAXED);
+    while(total > peak && !__atomic_compare_exchange_n(&max_pl, &peak, total, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Sets the number of arenas to one per online CPU, unless sf_set_arenas() already chose. Runs once.
+ */
+void init_arenas() {
+    if(arena_count) return;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    arena_count = cpus < 1 ? 1 : cpus > SF_MAX_ARENAS ? SF_MAX_ARENAS : cpus;
+}
+
+/**
+ * @brief Returns the arena the calling thread should allocate from
+ */
+sf_arena *get_arena() {
+    if(arena_mode == SF_ARENA_BY_CPU) {
+        pthread_once(&arenas_once, init_arenas);
+        int cpu = sched_getcpu();
+        return arenas + (cpu < 0 ? 0 : cpu % arena_count);
+    }
+    if(!thread_arena) {
+        pthread_once(&arenas_once, init_arenas);
+        thread_arena = arenas + __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % arena_count;
+    }
+    return thread_arena;
+}
+
+/**
+ * @brief Locks an arena, adds the calling thread's statistics delta for it to its statistics and releases
+ * the blocks other threads have freed into it since it was last locked
+ */
+void lock_arena(sf_arena *arena) {
+    // Neither the delta nor the arena may refer to a heap range that's been released
+    if(TCACHE_STALE) tcache_reset();
+    if(ARENAS_STALE) reset_arenas();
+    pthread_mutex_lock(&arena -> lock);
+    flush_delta(arena);
+    drain_remote_frees(arena);
+}
+
+void unlock_arena(sf_arena *arena) {
+    pthread_mutex_unlock(&arena -> lock);
+}
+
+/*
+ * Remote frees: a thread freeing a block that belongs to another thread's arena doesn't take that arena's lock.
+ * The block is pushed onto the arena's remote_frees stack with a single CAS instead, and whoever locks the
+ * arena next (normally its own thread, on its next slow path) releases the whole stack at once.
+ * Queued blocks are marked like quick list blocks, so they're never coalesced and freeing one again is caught by
+ * validate_pp(). They keep their payload size, which is subtracted from the arena's total when they're released.
+ */
+
+/**
+ * @brief Pushes a block onto the arena's remote free stack, without taking any lock
+ * @param block, pointer to the block header (already marked as in quick list, see sf_free())
+ */
+void push_remote_free(sf_arena *arena, sf_block *block) {
+    sf_block *head = __atomic_load_n(&arena -> remote_frees, __ATOMIC_RELAXED);
+    do {
+        block -> body.links.next = head;
+    } while(!__atomic_compare_exchange_n(&arena -> remote_frees, &head, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Releases every block on the arena's remote free stack
+ * @note Must be called with the arena's lock held. The stack is taken in one exchange, so there's no ABA problem
+ */
+void drain_remote_frees(sf_arena *arena) {
+    if(__atomic_load_n(&arena -> remote_frees, __ATOMIC_RELAXED)) {
+        sf_block *block = __atomic_exchange_n(&arena -> remote_frees, NULL, __ATOMIC_ACQUIRE);
+        while(block) {
+            sf_block *next = block -> body.links.next;
+            sf_header header = OBF(block -> header);
+            size_t pl_size = GET_PL_SIZE(header);
+            release_block(arena, block);
+            // Blocks drained from a thread cache have no payload left, they were subtracted when they were cached
+            if(pl_size) {
+                update_pl(arena, -(long)pl_size);
+                update_blocks(arena, -(long)pl_size, -(long)GET_BLOCK_SIZE(header));
+            }
+            block = next;
+        }
+    }
+    // Slab objects come from thread caches, so their payload was already subtracted
+    if(__atomic_load_n(&arena -> remote_slab_frees, __ATOMIC_RELAXED)) {
+        void *obj = __atomic_exchange_n(&arena -> remote_slab_frees, NULL, __ATOMIC_ACQUIRE);
+        while(obj) {
+            void *next = *(void **)obj;
+            slab_release(arena, obj);
+            obj = next;
+        }
+    }
+}
+
+/*
+ * Slabs (see sfmm.h): every slab is one page of objects of a single size class, with an sf_slab descriptor
+ * at the start of the page. Each arena keeps the slabs that have a free object in a list per size class, and
+ * the pages of slabs that became empty in another list, so they can be reused for any size class.
+ *
+ * Slab objects go through thread caches just like small blocks: a cached object is still marked as in use in
+ * its slab, and only the arena's lock protects the slab itself. A cached object holds the next link in its
+ * first word and slab_cache_key in its second, so freeing it again from the same thread is caught.
+ */
+
+// Address stored in cached slab objects, see validate_slab_pp()
+char slab_cache_key;
+
+/**
+ * @brief Allocates a slab object from the thread cache, refilling the cache from the thread's arena if it's empty
+ * @param size, requested size, from 1 to SLAB_MAX_SIZE
+ * @returns pointer to the object, NULL if no memory is left (sf_errno is set)
+ */
+void *slab_alloc(size_t size) {
+    if(TCACHE_STALE) tcache_reset();
+    int cls = SLAB_CLASS(size);
+    struct sf_slab_bin *bin = tcache.slab_bins + cls;
+    if(!bin -> first) slab_refill(cls);
+
+    void **obj = bin -> first;
+    if(!obj) return NULL;
+    bin -> first = obj[0];
+    bin -> length--;
+    obj[1] = NULL;
+    // The payload size of a slab object is its size class, nothing else is known when it's freed
+    tcache.deltas[sf_slab_index(obj)].pl += (cls + 1) * 16;
+    return obj;
+}
+
+/**
+ * @brief Frees a (validated) slab object into the thread cache, draining part of the cache first if it's full
+ */
+void slab_free(void *pp) {
+    if(TCACHE_STALE) tcache_reset();
+    size_t obj_size = SLAB_OF(pp) -> obj_size;
+    struct sf_slab_bin *bin = tcache.slab_bins + SLAB_CLASS(obj_size);
+    if(bin -> length >= TCACHE_MAX) slab_drain(bin, TCACHE_BATCH);
+
+    void **obj = pp;
+    obj[0] = bin -> first;
+    obj[1] = &slab_cache_key;
+    bin -> first = obj;
+    bin -> length++;
+    tcache.deltas[sf_slab_index(pp)].pl -= obj_size;
+}
+
+/**
+ * @brief Moves up to TCACHE_BATCH objects of size class cls from the thread's arena into the (empty) thread cache
+ */
+void slab_refill(int cls) {
+    struct sf_slab_bin *bin = tcache.slab_bins + cls;
+    tcache_register();
+
+    sf_arena *arena = get_arena();
+    lock_arena(arena);
+    int saved_errno = sf_errno;
+    for(int i = 0; i < TCACHE_BATCH; i++) {
+        void **obj = slab_take(arena, cls);
+        if(!obj) break;
+        obj[0] = bin -> first;
+        bin -> first = obj;
+        bin -> length++;
+    }
+    // Whatever was refilled is usable, so only report an error if nothing was
+    if(bin -> first) sf_errno = saved_errno;
+    unlock_arena(arena);
+}
+
+/**
+ * @brief Returns up to count objects from a thread cache bin to their slabs, like tcache_drain()
+ */
+void slab_drain(struct sf_slab_bin *bin, int count) {
+    sf_arena *own = get_arena();
+    int locked = 0;
+    while(bin -> first && count-- > 0) {
+        void *obj = bin -> first;
+        bin -> first = *(void **)obj;
+        bin -> length--;
+
+        sf_arena *arena = arenas + sf_slab_index(obj);
+        if(arena != own) {
+            push_remote_slab_free(arena, obj);
+            continue;
+        }
+        if(!locked) {
+            lock_arena(own);
+            locked = 1;
+        }
+        slab_release(own, obj);
+    }
+    if(locked) unlock_arena(own);
+}
+
+/**
+ * @brief Pushes a slab object onto the arena's remote slab free stack, like push_remote_free()
+ */
+void push_remote_slab_free(sf_arena *arena, void *obj) {
+    void *head = __atomic_load_n(&arena -> remote_slab_frees, __ATOMIC_RELAXED);
+    do {
+        *(void **)obj = head;
+    } while(!__atomic_compare_exchange_n(&arena -> remote_slab_frees, &head, obj, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Takes a free object of size class cls from the arena's slabs, starting a new slab if there's none
+ * @note Must be called with the arena's lock held
+ * @returns the object, NULL if no memory is left (sf_errno is set)
+ */
+void *slab_take(sf_arena *arena, int cls) {
+    struct sf_slab *slab = arena -> slabs[cls];
+    if(!slab) {
+        slab = new_slab(arena, cls);
+        if(!slab) return NULL;
+    }
+
+    // The slab has a free object, so there's a word of the bitmap that isn't full (bits past capacity are set)
+    int word = 0;
+    while(slab -> bitmap[word] == ~0ULL) word++;
+    int bit = __builtin_ctzll(~slab -> bitmap[word]);
+    slab -> bitmap[word] |= 1ULL << bit;
+    // A full slab leaves the list, it comes back when one of its objects is released
+    if(++slab -> used == slab -> capacity) unlink_slab(arena, slab);
+    return SLAB_OBJ(slab, word * 64 + bit);
+}
+
+/**
+ * @brief Marks a slab object as free in its slab. Slabs that become empty are given back to the arena's empty slabs,
+ * unless it's the only slab of the size class.
+ * @note Must be called with the arena's lock held
+ */
+void slab_release(sf_arena *arena, void *obj) {
+    struct sf_slab *slab = SLAB_OF(obj);
+    size_t i = ((char *)obj - SLAB_OBJ(slab, 0)) / slab -> obj_size;
+    slab -> bitmap[i / 64] &= ~(1ULL << (i % 64));
+
+    // A full slab isn't in any list
+    if(slab -> used-- == slab -> capacity) link_slab(arena, slab);
+    if(slab -> used == 0 && (slab -> prev || slab -> next)) {
+        unlink_slab(arena, slab);
+        slab -> next = arena -> empty_slabs;
+        arena -> empty_slabs = slab;
+    }
+}
+
+/**
+ * @brief Sets up a slab for size class cls and adds it to the arena's list for it.
+ * The page comes from the arena's empty slabs, otherwise SLAB_GROW_PAGES pages are committed at once.
+ * @note Must be called with the arena's lock held
+ * @returns the slab, NULL if no memory is left (sf_errno is set)
+ */
+struct sf_slab *new_slab(sf_arena *arena, int cls) {
+    struct sf_slab *slab = arena -> empty_slabs;
+    if(!slab) {
+        char *pages = sf_slab_grow_n(ARENA_INDEX(arena), SLAB_GROW_PAGES);
+        if(!pages) {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+        // Everything but the first page is kept for later
+        for(int i = SLAB_GROW_PAGES - 1; i > 0; i--) {
+            struct sf_slab *extra = (struct sf_slab *)(pages + i * PAGE_SZ);
+            extra -> next = arena -> empty_slabs;
+            arena -> empty_slabs = extra;
+        }
+        slab = (struct sf_slab *)pages;
+    } else {
+        arena -> empty_slabs = slab -> next;
+    }
+
+    slab -> obj_size = (cls + 1) * 16;
+    slab -> capacity = (PAGE_SZ - SLAB_HEADER_SIZE) / slab -> obj_size;
+    slab -> used = 0;
+    // Bits past capacity are set, so they're never handed out
+    for(int word = 0; word < 4; word++) {
+        int first = word * 64;
+        if(first + 64 <= slab -> capacity) slab -> bitmap[word] = 0;
+        else if(first >= slab -> capacity) slab -> bitmap[word] = ~0ULL;
+        else slab -> bitmap[word] = ~0ULL << (slab -> capacity - first);
+    }
+    link_slab(arena, slab);
+    return slab;
+}
+
+/**
+ * @brief Adds a slab to the front of the arena's list for its size class
+ */
+void link_slab(sf_arena *arena, struct sf_slab *slab) {
+    struct sf_slab **head = arena -> slabs + SLAB_CLASS(slab -> obj_size);
+    slab -> prev = NULL;
+    slab -> next = *head;
+    if(*head) (*head) -> prev = slab;
+    *head = slab;
+}
+
+/**
+ * @brief Removes a slab from the arena's list for its size class
+ */
+void unlink_slab(sf_arena *arena, struct sf_slab *slab) {
+    if(slab -> prev) slab -> prev -> next = slab -> next;
+    else arena -> slabs[SLAB_CLASS(slab -> obj_size)] = slab -> next;
+    if(slab -> next) slab -> next -> prev = slab -> prev;
+    slab -> next = slab -> prev = NULL;
+}
+
+/**
+ * @brief Validates a pointer into the slab slice of heap index, the slab version of validate_pp()
+ * @returns 0 if it's an object in use, -1 if not
+ */
+int validate_slab_pp(void *pp, int index) {
+    // Is it past the committed slab pages? Invalid
+    if((char *)pp >= (char *)sf_slab_end(index)) return -1;
+
+    struct sf_slab *slab = SLAB_OF(pp);
+    size_t obj_size = slab -> obj_size;
+    // Is the page not a slab (or not set up yet)? Invalid
+    if(obj_size < 16 || obj_size > SLAB_MAX_SIZE || obj_size % 16 != 0) return -1;
+    // Does it not point to the start of an object? Invalid
+    if((char *)pp < SLAB_OBJ(slab, 0)) return -1;
+    size_t offset = (char *)pp - SLAB_OBJ(slab, 0);
+    size_t i = offset / obj_size;
+    if(offset % obj_size != 0 || i >= slab -> capacity) return -1;
+    // Is the object free? Invalid
+    if(!(slab -> bitmap[i / 64] & (1ULL << (i % 64)))) return -1;
+
+    // Is it already in the calling thread's cache? Invalid (only looked for if it has the mark of a cached object,
+    // and the cache isn't left over from before sf_mem_fini(), its objects are gone)
+    void **obj = pp;
+    if(obj[1] == &slab_cache_key && !TCACHE_STALE) {
+        for(void **cur = tcache.slab_bins[SLAB_CLASS(obj_size)].first; cur != NULL; cur = cur[0]) {
+            if(cur == obj) return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Mapped chunks (see sfmm.h): a request of at least mmap_threshold bytes gets a mapping of its own, which
+ * belongs to no arena. The payload size is in the first row of the mapping and the header in the second, right
+ * before the payload, so a mapped chunk is told apart from a heap block by its header, and from a slab object
+ * or a heap block by its address being outside the reserved range.
+ */
+
+// Requests of at least this many bytes are mapped (see sf_set_mmap_threshold())
+size_t mmap_threshold = SF_MMAP_THRESHOLD;
+// Payload and mapping totals of every mapped chunk, for sf_fragmentation() and sf_utilization()
+long mmapped_pl = 0;
+long mmapped_size = 0;
+
+/*
+ * Registry of the live mapped chunks, so a pointer is known to be one before anything behind it is read: a chunk
+ * that was freed is unmapped, and reading its header would fault. It's a set of mapping starts with open addressing
+ * (linear probing), in memory mapped directly so it never allocates from the heaps. A removed entry leaves a
+ * tombstone behind, which keeps the probe sequences of the other entries intact until the table is rebuilt.
+ */
+#define MMAP_TABLE_MIN 256          // Initial number of slots (a power of two)
+#define MMAP_TOMBSTONE ((uintptr_t)1) // Slot of a removed entry (0 is an empty slot)
+// Slot a mapping start hashes to, mappings are page aligned so it's the page number that's hashed (Fibonacci hashing)
+#define MMAP_HASH(base, slots) ((size_t)((uintptr_t)(base) / PAGE_SZ * 0x9E3779B97F4A7C15ULL >> 32) & ((slots) - 1))
+static pthread_mutex_t mmap_lock = PTHREAD_MUTEX_INITIALIZER; // Protects the table
+static uintptr_t *mmap_table;       // Slots, NULL until the first chunk is mapped
+static size_t mmap_slots;           // Number of slots
+static size_t mmap_live;            // Entries in the table
+static size_t mmap_used;            // Entries and tombstones, kept under half the slots when possible
+
+void sf_set_mmap_threshold(size_t threshold) {
+    __atomic_store_n(&mmap_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+size_t sf_get_mmap_threshold() {
+    return __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+}
+
+size_t sf_mmap_size() {
+    return __atomic_load_n(&mmapped_size, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Returns whether a request of size bytes is served by a mapping, because it reaches the threshold
+ * or because its block size wouldn't fit in a header
+ */
+int wants_mmap(size_t size) {
+    return size >= sf_get_mmap_threshold() || size > MAX_BLOCK_SIZE - 2*MROW;
+}
+
+/**
+ * @brief Maps a chunk for a payload of size bytes
+ * @returns pointer to the payload, NULL if the mapping failed (sf_errno is set to ENOMEM)
+ */
+void *mmap_alloc(size_t size) {
+    // MMAP_SIZE would wrap around
+    if(size > SIZE_MAX - MMAP_OVERHEAD - PAGE_SZ) {
+        sf_errno = ENOMEM;
         return NULL;
-    // Check if heap_size is large enough to store the requested size
-    size_t heap_size = HEAP_SIZE();
+    }
+    size_t map_size = MMAP_SIZE(size);
+    sf_header *base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
 
-    // Check if heap_size is 0, if so, then initialize
-    if(heap_size == 0) {
-        initialize_free_lists();
-        int ret = initialize_heap();
-        if(ret) return NULL;
+    if(mmap_register(base, NULL) < 0) {
+        munmap(base, map_size);
+        sf_errno = ENOMEM;
+        return NULL;
     }
-    // printf("heap and free lists have been INITIALIZED SKIBIDi!!!!\n");
 
-    // Variable to store total block size (including padding and footer/header and everything)
-    size_t block_size = size + 2*MROW; // Adding 2 memory rows of space for header and footer 
+    // The heaps may not be initialized yet, and the key is needed to write the header
+    pthread_once(&obf_once, load_obf_key);
+    base[0] = OBF(size);
+    base[1] = OBF(map_size | IS_MMAPPED | THIS_BLOCK_ALLOCATED);
+    mmap_account(size, map_size);
+    return base + 2;
+}
+
+/**
+ * @brief Unmaps a (validated) mapped chunk
+ */
+void mmap_free(void *pp) {
+    sf_header *base = MMAP_BASE(pp);
+    size_t pl_size = OBF(base[0]);
+    size_t map_size = OBF(base[1]) & ~(PAGE_SZ - 1);
+    mmap_account(-(long)pl_size, -(long)map_size);
+    // Out of the registry first, a chunk mapped at the same address right after must not find it there
+    mmap_unregister(base);
+    munmap(base, map_size);
+}
+
+/**
+ * @brief Resizes a (validated) mapped chunk with mremap, which may move it
+ * @param rsize, new payload size, should still be served by a mapping (see wants_mmap())
+ * @returns pointer to the payload, NULL if it couldn't be resized (sf_errno is set to ENOMEM, the chunk is unchanged)
+ */
+void *mmap_realloc(void *pp, size_t rsize) {
+    sf_header *base = MMAP_BASE(pp);
+    size_t pl_size = OBF(base[0]);
+    size_t map_size = OBF(base[1]) & ~(PAGE_SZ - 1);
+    if(rsize > SIZE_MAX - MMAP_OVERHEAD - PAGE_SZ) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    // Only the page count matters to the kernel, the payload size can change within the same pages
+    size_t new_size = MMAP_SIZE(rsize);
+    if(new_size != map_size) {
+        sf_header *moved = mremap(base, map_size, new_size, MREMAP_MAYMOVE);
+        if(moved == MAP_FAILED) {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+        if(moved != base) mmap_register(moved, base);
+        base = moved;
+        base[1] = OBF(new_size | IS_MMAPPED | THIS_BLOCK_ALLOCATED);
+    }
+    base[0] = OBF(rsize);
+    mmap_account((long)rsize - (long)pl_size, (long)new_size - (long)map_size);
+    return base + 2;
+}
+
+/**
+ * @brief Adds to the totals of mapped chunks, and to the payload total across all arenas
+ * @param pl_size, change in payload
+ * @param map_size, change in mapped bytes
+ */
+void mmap_account(long pl_size, long map_size) {
+    __atomic_add_fetch(&mmapped_pl, pl_size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mmapped_size, map_size, __ATOMIC_RELAXED);
+    update_total_pl(pl_size);
+}
+
+/**
+ * @brief Validates a pointer outside of the reserved range, the mapped chunk version of validate_pp()
+ * @returns 0 if it's the payload of a mapped chunk, -1 if not
+ */
+int validate_mmap_pp(void *pp) {
+    // Is it not 16 bytes into a page? Invalid (checked before anything is read)
+    if((size_t)pp % PAGE_SZ != MMAP_OVERHEAD) return -1;
+    sf_header *base = MMAP_BASE(pp);
+    // Is it not a live mapped chunk, e.g. one already freed? Invalid (its pages may not be mapped anymore)
+    if(!mmap_registered(base)) return -1;
+
+    sf_header header = OBF(base[1]);
+    // Are the flags not exactly those of a mapped chunk? Invalid
+    if((header & (PAGE_SZ - 1)) != (IS_MMAPPED | THIS_BLOCK_ALLOCATED)) return -1;
+    // Does the mapping size not match the payload size? Invalid
+    size_t pl_size = OBF(base[0]);
+    if(pl_size == 0 || pl_size > SIZE_MAX - MMAP_OVERHEAD - PAGE_SZ) return -1;
+    if((header & ~(PAGE_SZ - 1)) != MMAP_SIZE(pl_size)) return -1;
+    return 0;
+}
+
+/**
+ * @brief Adds a mapped chunk to the registry
+ * @param base, start of the mapping
+ * @param old, start of the mapping before mremap moved it, which is removed in the same step, or NULL
+ * @returns 0 on success, -1 if the table couldn't grow to make room for a new chunk
+ */
+int mmap_register(sf_header *base, sf_header *old) {
+    pthread_mutex_lock(&mmap_lock);
+    if(old) {
+        mmap_table[mmap_slot(old)] = MMAP_TOMBSTONE;
+        mmap_live--;
+    }
+    // A failed growth only fails a new chunk: a moved one must stay registered, and there's still room for it
+    if((mmap_used + 1) * 2 > mmap_slots && mmap_table_grow() < 0 && (!old || mmap_used + 1 >= mmap_slots)) {
+        pthread_mutex_unlock(&mmap_lock);
+        return -1;
+    }
+    size_t i = MMAP_HASH(base, mmap_slots);
+    while(mmap_table[i] > MMAP_TOMBSTONE) i = (i + 1) & (mmap_slots - 1);
+    if(mmap_table[i] == 0) mmap_used++;
+    mmap_table[i] = (uintptr_t)base;
+    mmap_live++;
+    pthread_mutex_unlock(&mmap_lock);
+    return 0;
+}
+
+/**
+ * @brief Removes a mapped chunk from the registry, if it's there
+ */
+void mmap_unregister(sf_header *base) {
+    pthread_mutex_lock(&mmap_lock);
+    size_t i = mmap_slot(base);
+    if(i != SIZE_MAX) {
+        mmap_table[i] = MMAP_TOMBSTONE;
+        mmap_live--;
+    }
+    pthread_mutex_unlock(&mmap_lock);
+}
+
+/**
+ * @brief Returns whether base is the start of a live mapped chunk
+ */
+int mmap_registered(sf_header *base) {
+    pthread_mutex_lock(&mmap_lock);
+    int found = mmap_slot(base) != SIZE_MAX;
+    pthread_mutex_unlock(&mmap_lock);
+    return found;
+}
+
+/**
+ * @brief Finds the slot of a mapped chunk in the registry (mmap_lock must be held)
+ * @returns index of the slot, SIZE_MAX if the chunk isn't in the registry
+ */
+size_t mmap_slot(sf_header *base) {
+    if(!mmap_table) return SIZE_MAX;
+    size_t i = MMAP_HASH(base, mmap_slots);
+    // The table always has an empty slot, which ends every probe sequence
+    while(mmap_table[i] != 0) {
+        if(mmap_table[i] == (uintptr_t)base) return i;
+        i = (i + 1) & (mmap_slots - 1);
+    }
+    return SIZE_MAX;
+}
+
+/**
+ * @brief Rebuilds the registry with room for at least twice the live chunks, which drops the tombstones
+ * (mmap_lock must be held)
+ * @returns 0 on success, -1 if the new table couldn't be mapped (the old one is unchanged)
+ */
+int mmap_table_grow() {
+    size_t slots = MMAP_TABLE_MIN;
+    while(slots < (mmap_live + 1) * 4) slots *= 2;
+    uintptr_t *table = mmap(NULL, slots * sizeof(uintptr_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1, 0);
+    if(table == MAP_FAILED) return -1;
+    for(size_t j = 0; j < mmap_slots; j++) {
+        if(mmap_table[j] <= MMAP_TOMBSTONE) continue;
+        size_t i = MMAP_HASH(mmap_table[j], slots);
+        while(table[i] != 0) i = (i + 1) & (slots - 1);
+        table[i] = mmap_table[j];
+    }
+    if(mmap_table) munmap(mmap_table, mmap_slots * sizeof(uintptr_t));
+    mmap_table = table;
+    mmap_slots = slots;
+    mmap_used = mmap_live;
+    return 0;
+}
+
+/**
+ * @brief Computes the size of the block needed for a payload of pl_size bytes
+ * @param pl_size, payload size
+ * @returns block size, including header, footer and the padding to 16 bytes (at least MIN_BLOCK_SIZE)
+ */
+size_t calc_block_size(size_t pl_size) {
+    // Adding 2 memory rows of space for header and footer (only the header if footers are elided)
+    size_t block_size = pl_size + BLOCK_OVERHEAD;
     // Check edge cases
     // 1. if block_size is < 32
-    if(block_size < 32) block_size = 32;
-
+    if(block_size < MIN_BLOCK_SIZE) block_size = MIN_BLOCK_SIZE;
     // 2. if block_size is not 16-byte aligned
     // Add however much padding is needed
     if((block_size % 16) != 0) block_size += (16 - block_size % 16); 
-    // printf("Block size: %zu\n", block_size);
-    // Now, check if quick_lists should be searched or main lists, based on block_size
-    if (block_size < QL_MAX_SIZE) {
-        // Get QL index
-        int index = QL_INDEX(block_size);
-        // Pop from QL at index
-        sf_block *block = popQL(index);
-        // continue only if sf_block isn't NULL
+    return block_size;
+}
+
+void *sf_malloc(size_t size) {
+    void *pp = malloc_payload(size);
+    if (PROFILING && pp) sf_prof_malloc(pp, size);
+    return pp;
+}
+
+/**
+ * @brief Allocates a payload of size bytes, from a slab, a heap block or a mapping depending on the size (sf_malloc()
+ * without the profiler hook)
+ * @returns pointer to the payload, NULL if size is 0 or there's no memory left (sf_errno is set to ENOMEM)
+ */
+void *malloc_payload(size_t size) {
+    // Check if size is 0, return NULL in this case
+    if (size == 0)
+        return NULL;
+    // Small requests don't need a block at all
+    if (SF_SLABS && size <= SLAB_MAX_SIZE)
+        return slab_alloc(size);
+    // Large ones get their own mapping, so they never fragment a heap
+    if (wants_mmap(size))
+        return mmap_alloc(size);
+
+    // Variable to store total block size (including padding and footer/header and everything)
+    size_t block_size = calc_block_size(size);
+    // Small blocks come from the thread's own cache first, without taking a lock
+    if (TCACHED(block_size)) {
+        sf_block *block = tcache_pop(QL_INDEX(block_size), block_size);
         if(block) {
-            // Allocate the block
-            char *pp = create_malloc_block(block, size);
-            update_pl(size); 
-            return pp;
+            // The block may be slightly larger than block_size, if it wasn't worth splitting
+            tcache_count_block(block, size, GET_BLOCK_SIZE(OBF(block -> header)));
+            return create_malloc_block(block, size);
+        }
+    }
+
+    return heap_alloc(size, NULL);
+}
+
+/**
+ * @brief Allocates a heap block for a payload of size bytes from the calling thread's arena
+ * @param fresh, if not NULL, set to where the fresh part of the arena's heap started before the block was taken
+ * (see sf_calloc())
+ * @returns pointer to the payload, NULL if there's no memory left (sf_errno is set)
+ */
+void *heap_alloc(size_t size, char **fresh) {
+    sf_arena *arena = get_arena();
+    lock_arena(arena);
+    if(fresh) *fresh = arena -> fresh;
+    char *pp = NULL;
+    sf_block *block = take_block(arena, calc_block_size(size));
+    if(block) {
+        // Create allocated block from the block that was taken (which may be larger than block_size)
+        pp = create_malloc_block(block, size); 
+        update_pl(arena, size); 
+        update_blocks(arena, size, GET_BLOCK_SIZE(OBF(block -> header)));
+    }
+    unlock_arena(arena);
+    return pp;
+}
+
+void *sf_calloc(size_t nmemb, size_t size) {
+    size_t total;
+    if(__builtin_mul_overflow(nmemb, size, &total)) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    void *pp = calloc_payload(total);
+    if (PROFILING && pp) sf_prof_malloc(pp, total);
+    return pp;
+}
+
+/**
+ * @brief Allocates a zeroed payload of size bytes, like malloc_payload() followed by only as much clearing as needed
+ * @returns pointer to the payload, NULL if size is 0 or there's no memory left (sf_errno is set to ENOMEM)
+ */
+void *calloc_payload(size_t size) {
+    if (size == 0)
+        return NULL;
+    // New mappings are always zero
+    if (wants_mmap(size))
+        return mmap_alloc(size);
+    // Slab objects and quick list blocks are small and usually reused, so they're just cleared
+    if ((SF_SLABS && size <= SLAB_MAX_SIZE) || calc_block_size(size) < QL_MAX_SIZE) {
+        void *pp = malloc_payload(size);
+        if(pp) memset(pp, 0, size);
+        return pp;
+    }
+
+    char *fresh;
+    char *pp = heap_alloc(size, &fresh);
+    if(pp) clear_payload(pp, size, fresh);
+    return pp;
+}
+
+/**
+ * @brief Zeroes a payload that was just taken from the heap, except for the part in pages no block had been taken
+ * from, which are still zero from the kernel
+ * @param fresh, start of the arena's fresh part before the block was taken (see mark_used())
+ */
+void clear_payload(char *pp, size_t size, char *fresh) {
+    // Even in fresh pages, the free block the payload came from had its links at the start and its footer at the end
+    size_t dirty = fresh > pp ? (size_t)(fresh - pp) : 0;
+    if(dirty < 2 * MROW) dirty = 2 * MROW;
+    if(dirty >= size) {
+        memset(pp, 0, size);
+        return;
+    }
+    memset(pp, 0, dirty);
+    sf_block *block = (sf_block *)(pp - MROW);
+    char *footer = (char *)FOOTER(block);
+    if(footer < pp + size) memset(footer, 0, pp + size - footer);
+}
+
+/**
+ * @brief Moves the start of the arena's fresh part past end, if it isn't already.
+ * Everything from there to the epilogue is zero, apart from the header, links and footer of the free block it's in.
+ * That holds as long as this is called for every block taken from the heap, and whenever coalescing leaves a header
+ * (and links) behind inside a block.
+ * @note Must be called with the arena's lock held
+ */
+void mark_used(sf_arena *arena, char *end) {
+    if(end > arena -> fresh) arena -> fresh = end;
+}
+
+void *sf_aligned_alloc(size_t align, size_t size) {
+    void *pp = aligned_payload(align, size);
+    if (PROFILING && pp) sf_prof_malloc(pp, size);
+    return pp;
+}
+
+int sf_posix_memalign(void **memptr, size_t align, size_t size) {
+    // Like posix_memalign(), the alignment also has to be a multiple of the pointer size. Checked here rather than
+    // left to sf_aligned_alloc(), whose NULL doesn't mean an error when size is 0
+    if(align == 0 || (align & (align - 1)) || align % sizeof(void *) != 0) {
+        sf_errno = EINVAL;
+        return EINVAL;
+    }
+    void *pp = sf_aligned_alloc(align, size);
+    if(!pp && size) return sf_errno;
+    *memptr = pp;
+    return 0;
+}
+
+/**
+ * @brief Allocates a payload of size bytes aligned to align, sf_aligned_alloc() without the profiler hook.
+ * Alignments of up to 16 bytes are what every payload has anyway. Small requests with an alignment that divides
+ * the start of the first object in a slab are rounded up to a size class that's a multiple of it, every object of
+ * that class is then aligned. Everything else is served from a heap block placed so its payload is aligned.
+ * @returns pointer to the payload, NULL if size is 0 or on error (sf_errno is set to EINVAL or ENOMEM)
+ */
+void *aligned_payload(size_t align, size_t size) {
+    // Has to be a power of two
+    if(align == 0 || (align & (align - 1))) {
+        sf_errno = EINVAL;
+        return NULL;
+    }
+    if(align <= 16) return malloc_payload(size);
+    if(size == 0) return NULL;
+    if(SF_SLABS && size <= SLAB_MAX_SIZE && align <= SLAB_HEADER_SIZE)
+        return slab_alloc((size + align - 1) & ~(align - 1));
+
+    // Mapped payloads are always 16 bytes into a page, so even large requests are placed in a heap.
+    // The block has to have room for the payload and for a gap in front of it that is a valid free block.
+    size_t block_size = calc_block_size(size);
+    if(size > MAX_BLOCK_SIZE || align > MAX_BLOCK_SIZE || block_size + align + MIN_BLOCK_SIZE > MAX_BLOCK_SIZE) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    sf_arena *arena = get_arena();
+    lock_arena(arena);
+    char *pp = NULL;
+    sf_block *block = take_aligned_block(arena, block_size, align);
+    if(block) {
+        pp = create_malloc_block(block, size);
+        update_pl(arena, size);
+        update_blocks(arena, size, GET_BLOCK_SIZE(OBF(block -> header)));
+    }
+    unlock_arena(arena);
+    return pp;
+}
+
+/**
+ * @brief Like take_block(), but the payload of the block taken is aligned to align. The gap in front of it is split
+ * off as a free block of its own, and whatever is left after it by split_free_block().
+ * @note Must be called with the arena's lock held. Quick lists are skipped, their blocks only have room for an
+ * aligned payload by chance.
+ * @param align, power of two larger than 16
+ * @returns the block, NULL if there's no memory left (sf_errno is set)
+ */
+sf_block *take_aligned_block(sf_arena *arena, size_t block_size, size_t align) {
+    if(HEAP_SIZE(arena) == 0) {
+        initialize_free_lists(arena);
+        int ret = initialize_heap(arena);
+        if(ret) return NULL;
+    }
+
+    sf_block *fit_block = aligned_fit(arena, block_size, align);
+    if(!fit_block) {
+        // The coalesced block is large enough whatever its alignment, like any block aligned_fit() falls back to
+        fit_block = extend_heap(arena, pages_needed(arena, block_size + align + MIN_BLOCK_SIZE));
+        if(!fit_block) return NULL;
+    }
+    unlink_block(arena, fit_block);
+
+    size_t gap = align_gap(fit_block, align);
+    if(gap) {
+        // The aligned block follows the gap, which is still free, so it's written first (see split_free_block())
+        sf_block *aligned = (sf_block *)((char *)fit_block + gap);
+        size_t fb_size = GET_BLOCK_SIZE(OBF(fit_block -> header));
+        aligned -> header = OBF(0);
+        create_free_block(fb_size - gap, (char *)aligned);
+        // The block before fit_block is allocated (free blocks are always coalesced), so the gap needs no coalescing
+        insert_ml(arena, create_free_block(gap, (char *)fit_block));
+        fit_block = aligned;
+    }
+    sf_block *block = split_free_block(arena, fit_block, block_size);
+    mark_used(arena, (char *)NEXT_BLOCK(block));
+    return block;
+}
+
+/**
+ * @brief Finds a free block with room for a block of block_size whose payload is aligned to align.
+ * Blocks smaller than block_size + align + MIN_BLOCK_SIZE only fit if they happen to be placed right, so the lists
+ * they can be in are walked and checked one by one. Any larger block fits, so the search then falls back to
+ * find_fit() for that size.
+ * @returns the block (still in its list), NULL if none was found
+ */
+sf_block *aligned_fit(sf_arena *arena, size_t block_size, size_t align) {
+    size_t needed = block_size + align + MIN_BLOCK_SIZE;
+    int last = get_ml_index(needed);
+    for(int index = find_nonempty_list(arena, get_ml_index(block_size)); index >= 0 && index <= last;
+        index = find_nonempty_list(arena, index + 1)) {
+        sf_block *sentinel = arena -> free_list_heads + index;
+        for(sf_block *cur = sentinel -> body.links.next; cur != sentinel; cur = cur -> body.links.next) {
+            if(GET_BLOCK_SIZE(OBF(cur -> header)) >= align_gap(cur, align) + block_size) return cur;
         }
     }
+    return find_fit(arena, needed);
+}
+
+/**
+ * @brief Computes how far into a free block the header of a block with an aligned payload would be.
+ * The gap is either 0 or large enough to be a free block, so it's less than align + MIN_BLOCK_SIZE.
+ * @param align, power of two larger than 16 (so at least MIN_BLOCK_SIZE)
+ */
+size_t align_gap(sf_block *block, size_t align) {
+    size_t pp = (size_t)block + MROW;
+    size_t gap = ((pp + align - 1) & ~(align - 1)) - pp;
+    if(gap && gap < MIN_BLOCK_SIZE) gap += align;
+    return gap;
+}
+
+/**
+ * @brief Takes a block of at least block_size out of the arena's heap, initializing the heap first if needed
+ * @note Must be called with the arena's lock held. The block is in no list, but it's still marked free (or in quick list),
+ * so it has to be marked allocated before the lock is released.
+ * @param block_size, size of the block needed (already padded)
+ * @returns the block, NULL if there's no memory left (sf_errno is set)
+ */
+sf_block *take_block(sf_arena *arena, size_t block_size) {
+    // Check if heap_size is 0, if so, then initialize
+    if(HEAP_SIZE(arena) == 0) {
+        initialize_free_lists(arena);
+        int ret = initialize_heap(arena);
+        if(ret) return NULL;
+    }
+
+    // Now, check if quick_lists should be searched or main lists, based on block_size
+    if (block_size < QL_MAX_SIZE) {
+        // Pop from QL at index, continue only if the block isn't NULL
+        sf_block *block = popQL(arena, QL_INDEX(block_size));
+        if(block) return block;
+    }
     // Now, implement checking main list whenever the size is either too large for quick list
     // when the corresponding quick list is empty
     // Note: Since the new memory will coalesce with the old, there's no edge case like needing to check the quicklist since 
     // there's no way for anything to be stored into quicklist when extending the heap.
-    sf_block *fit_block = NULL;
-    do {
-        // Find a block that fits the block size
-        fit_block = find_fit(block_size); 
-        // printf("after finding fit block\n");
-        // If fit_block is null, extend heap an continue to next iteration
-        if(!fit_block) {
-            // printf("extending heap\n");
-            int ret = extend_heap();
-            // If ret is -1, that means no more space, return NULL
-            if(ret) return NULL;
-            // else, continue
-            continue;
-        }
+    // Find a block that fits the block size
+    sf_block *fit_block = find_fit(arena, block_size); 
+    // If fit_block is null, grow the heap by every page the request still needs in one go.
+    // The coalesced block extend_heap returns is guaranteed to be large enough.
+    if(!fit_block) {
+        fit_block = extend_heap(arena, pages_needed(arena, block_size));
+        // If NULL, that means no more space (sf_errno is already set)
+        if(!fit_block) return NULL;
+    }
 
-        // Else, unlink the block, effectively removing it from the main list
-        unlink_block(fit_block);
-    } while(!fit_block);
+    // Unlink the block, effectively removing it from the main list
+    unlink_block(arena, fit_block);
     // Now that fit_block has been grabbed, split as needed and then return that block of memory
     // Remember: block_size is the minimum size needed for the size passed in, the fit_block size can be >= to this
-    fit_block = split_free_block(fit_block, block_size);
-    
-    // Create allocated block from fit_block
-    char* pp = create_malloc_block(fit_block, size); 
-    update_pl(size); 
-    return pp;
+    sf_block *block = split_free_block(arena, fit_block, block_size);
+    mark_used(arena, (char *)NEXT_BLOCK(block));
+    return block;
+}
+
+/**
+ * Note for self:
+ *   *pp points to the payload, not the header
+ */
+void sf_free(void *pp) {
+    // Validate pointer
+    int ret = validate_pp(pp);
+    if(ret) abort();
+    if(PROFILING) sf_prof_free(pp);
+
+    // Slab objects have no header, they only go back to the thread's cache
+    if(sf_slab_index(pp) >= 0) {
+        slab_free(pp);
+        return;
+    }
+    // Neither in a heap nor in a slab, so it's a mapped chunk (it was validated)
+    if(sf_heap_index(pp) < 0) {
+        mmap_free(pp);
+        return;
+    }
+
+    // Grab header
+    sf_block *block = (sf_block *)((char*) pp - MROW);
+    sf_header header = (sf_header) OBF(block -> header);
+    // Grab block size, and pl_size for updating the running and max
+    free_heap_block(block, GET_BLOCK_SIZE(header), GET_PL_SIZE(header));
+}
+
+void sf_free_sized(void *pp, size_t size) {
+    if(!pp) return;
+#ifdef DEBUG
+    // Only DEBUG builds check the pointer, and that the size matches (slab objects only know their size class)
+    if(validate_pp(pp) || (sf_slab_index(pp) < 0 && sf_usable_size(pp) != size)) abort();
+#endif
+    if(PROFILING) sf_prof_free(pp);
+    if(sf_slab_index(pp) >= 0) {
+        slab_free(pp);
+        return;
+    }
+    if(sf_heap_index(pp) < 0) {
+        mmap_free(pp);
+        return;
+    }
+    // The block may be larger than the size needs, so its size still comes from the header
+    sf_block *block = (sf_block *)((char *)pp - MROW);
+    free_heap_block(block, GET_BLOCK_SIZE(OBF(block -> header)), size);
+}
+
+/**
+ * @brief Frees a (valid) heap block, the part of sf_free() after the pointer is known to be one
+ * @param pl_size, its payload size, subtracted from the statistics
+ */
+void free_heap_block(sf_block *block, size_t block_size, size_t pl_size) {
+    // Small blocks go back to the thread's own cache, whichever arena they came from
+    if(TCACHED(block_size)) {
+        tcache_push(block);
+        tcache_count_block(block, -(long)pl_size, -(long)block_size);
+        return;
+    }
+
+    // Everything else goes back to the arena that owns it, through its remote free stack if that's not
+    // the calling thread's arena
+    sf_arena *arena = ARENA_OF(block);
+    if(arena != get_arena()) {
+        flip_header_bits(block, IN_QUICK_LIST);
+        push_remote_free(arena, block);
+        return;
+    }
+    lock_arena(arena);
+    release_block(arena, block);
+    // update the running totals by the negative
+    update_pl(arena, -(long)pl_size);
+    update_blocks(arena, -(long)pl_size, -(long)block_size);
+    unlock_arena(arena);
+}
+
+size_t sf_usable_size(void *pp) {
+    if(validate_pp(pp)) return 0;
+    if(sf_slab_index(pp) >= 0) return SLAB_OF(pp) -> obj_size;
+    if(sf_heap_index(pp) < 0) return OBF(MMAP_BASE(pp)[0]);
+    return GET_PL_SIZE(OBF(((sf_block *)((char *)pp - MROW)) -> header));
+}
+
+/**
+ * @brief Returns an allocated (or quick list) block to the heap. Quick list sizes go onto their quick list as they
+ * are, they're only coalesced once they're flushed. Anything larger is turned into a free block, coalesced, and
+ * inserted into the main list that matches its size.
+ * @note Must be called with the arena's lock held
+ * @param block, pointer to the block header
+ */
+void release_block(sf_arena *arena, sf_block *block) {
+    size_t block_size = GET_BLOCK_SIZE(OBF(block -> header));
+    if(block_size < QL_MAX_SIZE) {
+        insert_ql(arena, block);
+        return;
+    }
+
+    // Create free block starting at the header with the given block size 
+    sf_block * free_block = create_free_block(block_size, (char *)block); 
+    // Coalesce the free block
+    free_block = coalesce(arena, free_block);
+    insert_ml(arena, free_block);
+}
+
+/*
+ * Batches (see sf_malloc_batch()): the size is only looked at once, and whatever can't be served from the thread
+ * cache is taken under a single arena lock. Heap blocks are carved side by side out of as few free blocks as
+ * possible, each one found for the whole remaining run, with the leftover split off once at the end.
+ */
+
+size_t sf_malloc_batch(size_t size, size_t n, void **ptrs) {
+    size_t count = malloc_batch(size, n, ptrs);
+    if(PROFILING) {
+        for(size_t i = 0; i < count; i++) sf_prof_malloc(ptrs[i], size);
+    }
+    return count;
+}
+
+/**
+ * @brief Allocates n payloads of size bytes into ptrs, sf_malloc_batch() without the profiler hook
+ * @returns how many were allocated, less than n if memory ran out (sf_errno is set to ENOMEM)
+ */
+size_t malloc_batch(size_t size, size_t n, void **ptrs) {
+    if(size == 0) return 0;
+    if(SF_SLABS && size <= SLAB_MAX_SIZE) return slab_alloc_batch(size, n, ptrs);
+    size_t done = 0;
+    if(wants_mmap(size)) {
+        while(done < n && (ptrs[done] = mmap_alloc(size))) done++;
+        return done;
+    }
+
+    // Whatever the thread cache has goes first, without a lock (checked first so tcache_pop() doesn't refill it)
+    size_t block_size = calc_block_size(size);
+    if(TCACHED(block_size)) {
+        // These blocks come back through the thread cache, which has to be emptied when the thread exits
+        tcache_register();
+        struct sf_quick_list *bin = tcache.bins + QL_INDEX(block_size);
+        while(done < n && bin -> first) {
+            sf_block *block = tcache_pop(QL_INDEX(block_size), block_size);
+            tcache_count_block(block, size, GET_BLOCK_SIZE(OBF(block -> header)));
+            ptrs[done++] = create_malloc_block(block, size);
+        }
+    }
+    if(done < n) done += heap_alloc_batch(size, n - done, ptrs + done);
+    return done;
+}
+
+/**
+ * @brief Allocates n slab objects for requests of size bytes, first from the thread cache and then straight from
+ * the arena's slabs under one lock
+ * @returns how many were allocated, less than n if memory ran out (sf_errno is set)
+ */
+size_t slab_alloc_batch(size_t size, size_t n, void **ptrs) {
+    if(TCACHE_STALE) tcache_reset();
+    struct sf_slab_bin *bin = tcache.slab_bins + SLAB_CLASS(size);
+    size_t done = 0;
+    while(done < n && bin -> first) ptrs[done++] = slab_alloc(size);
+    if(done == n) return done;
+
+    tcache_register();
+    sf_arena *arena = get_arena();
+    lock_arena(arena);
+    size_t taken = 0;
+    void **obj;
+    while(done + taken < n && (obj = slab_take(arena, SLAB_CLASS(size)))) {
+        // It may have been cached before, see slab_alloc()
+        obj[1] = NULL;
+        ptrs[done + taken++] = obj;
+    }
+    update_pl(arena, taken * (SLAB_CLASS(size) + 1) * 16);
+    unlock_arena(arena);
+    return done + taken;
+}
+
+/**
+ * @brief Allocates n heap blocks for payloads of size bytes from the calling thread's arena, taking its lock once.
+ * Quick list sizes come from the arena's quick list first.
+ * @returns how many were allocated, less than n if memory ran out (sf_errno is set)
+ */
+size_t heap_alloc_batch(size_t size, size_t n, void **ptrs) {
+    size_t block_size = calc_block_size(size);
+    sf_arena *arena = get_arena();
+    lock_arena(arena);
+    size_t done = 0;
+    long total_size = 0;
+    if(HEAP_SIZE(arena) == 0) {
+        initialize_free_lists(arena);
+        if(initialize_heap(arena)) n = 0;
+    }
+
+    if(block_size < QL_MAX_SIZE) {
+        sf_block *block;
+        while(done < n && (block = popQL(arena, QL_INDEX(block_size)))) {
+            total_size += GET_BLOCK_SIZE(OBF(block -> header));
+            ptrs[done++] = create_malloc_block(block, size);
+        }
+    }
+    while(done < n) {
+        sf_block *run = take_run(arena, block_size, n - done);
+        if(!run) break;
+        size_t carved = carve_blocks(arena, run, block_size, size, n - done, ptrs + done);
+        // The last block carved may have taken the leftover, so the size is measured rather than multiplied
+        sf_block *last = (sf_block *)((char *)ptrs[done + carved - 1] - MROW);
+        total_size += (char *)NEXT_BLOCK(last) - (char *)run;
+        done += carved;
+    }
+
+    update_pl(arena, done * size);
+    update_blocks(arena, done * size, total_size);
+    unlock_arena(arena);
+    return done;
+}
+
+/**
+ * @brief Takes a free block out of the arena's main lists with room for up to count blocks of block_size, preferring
+ * one that fits them all, then any block that fits one, and only then extending the heap for all of them
+ * @note Must be called with the arena's lock held, the heap must be initialized
+ * @returns the block (in no list, still marked free), NULL if there's no memory left (sf_errno is set)
+ */
+sf_block *take_run(sf_arena *arena, size_t block_size, size_t count) {
+    if(count > MAX_BLOCK_SIZE / block_size) count = MAX_BLOCK_SIZE / block_size;
+    sf_block *run = find_fit(arena, count * block_size);
+    if(!run && count > 1) run = find_fit(arena, block_size);
+    if(!run) {
+        run = extend_heap(arena, pages_needed(arena, count * block_size));
+        // Failing that, a single block may still fit
+        if(!run && count > 1) run = extend_heap(arena, pages_needed(arena, block_size));
+        if(!run) return NULL;
+    }
+    unlink_block(arena, run);
+    return run;
+}
+
+/**
+ * @brief Carves as many allocated blocks of block_size as fit (up to count) from the start of a free block, in one
+ * pass. What's left after them is a new free block, unless it's too small, then the last block takes it.
+ * @param run, free block in no list, at least block_size large
+ * @param ptrs, where the payload pointers are stored
+ * @note Must be called with the arena's lock held
+ * @returns the number of blocks carved
+ */
+size_t carve_blocks(sf_arena *arena, sf_block *run, size_t block_size, size_t pl_size, size_t count, void **ptrs) {
+    size_t left = GET_BLOCK_SIZE(OBF(run -> header));
+    if(count > left / block_size) count = left / block_size;
+    // The first block keeps the run's previous-allocated bit, every later one follows an allocated block
+    sf_header prev_alloc = PREV_ALLOC(OBF(run -> header));
+    char *cur = (char *)run;
+    for(size_t i = 0; i < count; i++) {
+        size_t b_size = (i == count - 1 && left - block_size < MIN_BLOCK_SIZE) ? left : block_size;
+        sf_block *block = (sf_block *)cur;
+        block -> header = OBF(PACK(pl_size, b_size, 0, 1) | prev_alloc);
+        if(!SF_FOOTER_ELISION) *FOOTER(block) = block -> header;
+        ptrs[i] = cur + MROW;
+        prev_alloc = PREV_BLOCK_ALLOCATED;
+        cur += b_size;
+        left -= b_size;
+    }
+    mark_used(arena, cur);
+
+    if(left) {
+        // The leftover follows an allocated block now, the block after it still follows a free one
+        ((sf_block *)cur) -> header = OBF(PREV_BLOCK_ALLOCATED);
+        insert_ml(arena, create_free_block(left, cur));
+    } else {
+        set_prev_alloc((sf_block *)cur, 1);
+    }
+    return count;
+}
+
+void sf_free_batch(void **ptrs, size_t n) {
+    // Blocks of the calling thread's arena that go back to its heap are collected here, and released under one lock
+    sf_block *own_list = NULL;
+    sf_arena *own = NULL;
+    long pl_total = 0, size_total = 0;
+
+    for(size_t i = 0; i < n; i++) {
+        void *pp = ptrs[i];
+        if(validate_pp(pp)) abort();
+        if(PROFILING) sf_prof_free(pp);
+
+        if(sf_slab_index(pp) >= 0) {
+            slab_free(pp);
+            continue;
+        }
+        if(sf_heap_index(pp) < 0) {
+            mmap_free(pp);
+            continue;
+        }
+
+        sf_block *block = (sf_block *)((char *)pp - MROW);
+        sf_header header = OBF(block -> header);
+        size_t block_size = GET_BLOCK_SIZE(header);
+        size_t pl_size = GET_PL_SIZE(header);
+        if(TCACHED(block_size)) {
+            tcache_push(block);
+            tcache_count_block(block, -(long)pl_size, -(long)block_size);
+            continue;
+        }
+
+        // Marked like a remote free either way, so the same pointer appearing again in the batch is caught
+        sf_arena *arena = ARENA_OF(block);
+        flip_header_bits(block, IN_QUICK_LIST);
+        if(!own) own = get_arena();
+        if(arena != own) {
+            push_remote_free(arena, block);
+            continue;
+        }
+        block -> body.links.next = own_list;
+        own_list = block;
+        pl_total += pl_size;
+        size_total += block_size;
+    }
+
+    if(own_list) {
+        lock_arena(own);
+        release_batch(own, own_list);
+        update_pl(own, -pl_total);
+        update_blocks(own, -pl_total, -size_total);
+        unlock_arena(own);
+    }
+}
+
+/**
+ * @brief Releases a list of blocks linked through their next links, coalescing each one and inserting it into the
+ * list that matches its size
+ * @note Must be called with the arena's lock held
+ */
+void release_batch(sf_arena *arena, sf_block *list) {
+    while(list) {
+        sf_block *next = list -> body.links.next;
+        release_block(arena, list);
+        list = next;
+    }
+}
+
+/*
+ * Thread caches: every thread keeps up to TCACHE_MAX blocks of each quick list size, so that small
+ * allocations and frees don't need a lock. Blocks in a thread cache are marked exactly like quick list
+ * blocks (allocated + in quick list), so they're never coalesced and freeing one again is caught by
+ * validate_pp(). Caches are refilled from the thread's arena, and drained back to the arena each block
+ * belongs to, TCACHE_BATCH blocks at a time. Building with TCACHE_MAX=0 bypasses them, so small blocks go
+ * straight to the quick lists under the arena's lock (slab objects still pass through a cache of one).
+ *
+ * The payload total is tracked per thread (and arena) as well and only added to an arena's running_pl when
+ * the thread takes that arena's lock, so the peak used by sf_utilization() is sampled at those points.
+ */
+
+/**
+ * @brief Pops a block from the thread cache for the given quick list index, refilling it from the heap if it's empty
+ * @param index, quick list index of block_size
+ * @param block_size, size of the blocks to refill with
+ * @returns the block (still marked as in quick list), NULL if no memory is left (sf_errno is set)
+ */
+sf_block *tcache_pop(int index, size_t block_size) {
+    if(TCACHE_STALE) tcache_reset();
+    struct sf_quick_list *bin = tcache.bins + index;
+    if(!bin -> first) tcache_refill(index, block_size);
+
+    sf_block *block = bin -> first;
+    if(!block) return NULL;
+    bin -> first = block -> body.links.next;
+    bin -> length--;
+    block -> body.links.next = NULL;
+    return block;
+}
+
+/**
+ * @brief Pushes a block onto the thread cache for its size, draining part of the cache to the heap first if it's full
+ * @param block, pointer to the block header (allocated, with a quick list size)
+ */
+void tcache_push(sf_block *block) {
+    if(TCACHE_STALE) tcache_reset();
+    sf_header header = OBF(block -> header);
+    size_t block_size = GET_BLOCK_SIZE(header);
+    struct sf_quick_list *bin = tcache.bins + QL_INDEX(block_size);
+    if(bin -> length >= TCACHE_MAX) tcache_drain(bin, TCACHE_BATCH);
+
+    // Mark it like a quick list block (with no payload), so it can't be coalesced or freed again
+    flip_header_bits(block, IN_QUICK_LIST | (GET_PL_SIZE(header) << 32));
+    block -> body.links.next = bin -> first;
+    bin -> first = block;
+    bin -> length++;
+}
+
+/**
+ * @brief Moves up to TCACHE_BATCH blocks of block_size from the thread's arena into the (empty) thread cache bin at index
+ */
+void tcache_refill(int index, size_t block_size) {
+    struct sf_quick_list *bin = tcache.bins + index;
+    tcache_register();
+
+    sf_arena *arena = get_arena();
+    lock_arena(arena);
+    int saved_errno = sf_errno;
+    for(int i = 0; i < TCACHE_BATCH; i++) {
+        sf_block *block = take_block(arena, block_size);
+        if(!block) break;
+        // Blocks taken from the main list are marked free, they have to be marked before the lock is released
+        set_header(block, PACK(0, GET_BLOCK_SIZE(OBF(block -> header)), 1, 1));
+        block -> body.links.next = bin -> first;
+        bin -> first = block;
+        bin -> length++;
+    }
+    // Whatever was refilled is usable, so only report an error if nothing was
+    if(bin -> first) sf_errno = saved_errno;
+    unlock_arena(arena);
+}
+
+/**
+ * @brief Returns up to count blocks from a thread cache bin to the arenas they belong to.
+ * Blocks from the thread's own arena are returned under one lock, others go through their arena's remote free stack.
+ */
+void tcache_drain(struct sf_quick_list *bin, int count) {
+    sf_arena *own = get_arena();
+    int locked = 0;
+    while(bin -> first && count-- > 0) {
+        sf_block *block = bin -> first;
+        bin -> first = block -> body.links.next;
+        bin -> length--;
+
+        sf_arena *arena = ARENA_OF(block);
+        if(arena != own) {
+            push_remote_free(arena, block);
+            continue;
+        }
+        if(!locked) {
+            lock_arena(own);
+            locked = 1;
+        }
+        release_block(own, block);
+    }
+    if(locked) unlock_arena(own);
+}
+
+/**
+ * @brief Adds an allocated block to the thread's statistics delta for the arena it belongs to, or removes it
+ * with a negative payload and block size. For blocks that become allocated or free without the arena's lock.
+ */
+void tcache_count_block(sf_block *block, long pl_size, long block_size) {
+    struct sf_delta *delta = tcache.deltas + sf_heap_index(block);
+    delta -> pl += pl_size;
+    delta -> block_pl += pl_size;
+    delta -> block_size += block_size;
+}
+
+/**
+ * @brief Adds the thread's statistics delta for the arena to the arena's statistics and resets it
+ * @note Must be called with the arena's lock held
+ */
+void flush_delta(sf_arena *arena) {
+    struct sf_delta *delta = tcache.deltas + ARENA_INDEX(arena);
+    if(!delta -> pl && !delta -> block_size) return;
+    update_pl(arena, delta -> pl);
+    update_blocks(arena, delta -> block_pl, delta -> block_size);
+    *delta = (struct sf_delta){0};
 }
 
 /**
- * Note for self:
- *   *pp points to the payload, not the header
+ * @brief Flushes the calling thread's statistics deltas for every arena
  */
-void sf_free(void *pp) {
-    // Validate pointer
-    int ret = validate_pp(pp);
-    if(ret) abort();
+void flush_all_deltas() {
+    for(int i = 0; i < SF_MAX_ARENAS; i++) {
+        if(!tcache.deltas[i].pl && !tcache.deltas[i].block_size) continue;
+        lock_arena(arenas + i);
+        unlock_arena(arenas + i);
+    }
+}
 
-    // Grab header
-    sf_header *hPtr = (sf_header *)((char*) pp - MROW);
-    sf_header header = (sf_header) OBF(*hPtr);
-    // Grab block size
-    size_t block_size = GET_BLOCK_SIZE(header);
-    // Grab pl_size for updating the running and max
-    size_t pl_size = GET_PL_SIZE(header);
+/**
+ * @brief Thread exit hook (pthread key destructor), returns everything in the exiting thread's cache to the heap
+ */
+void tcache_destroy(void *unused) {
+    (void) unused;
+    // Blocks cached before sf_mem_fini() have nowhere to go back to
+    if(TCACHE_STALE) tcache_reset();
+    for(int i = 0; i < NUM_QUICK_LISTS; i++) {
+        if(tcache.bins[i].first) tcache_drain(tcache.bins + i, TCACHE_MAX);
+    }
+    for(int i = 0; i < SLAB_CLASSES; i++) {
+        if(tcache.slab_bins[i].first) slab_drain(tcache.slab_bins + i, TCACHE_MAX);
+    }
+    flush_all_deltas();
+}
 
-    // Create free block starting at the header with the given block size 
-    sf_block * free_block = create_free_block(block_size, (char *)hPtr); 
-    // Coalesce the free block
-    free_block = coalesce(free_block);
-    // Grab new block size
-    block_size = GET_BLOCK_SIZE(OBF(free_block -> header));
+void tcache_create_key() {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
 
-    // Based on block_size, insert into corresponding list
-    if(block_size < QL_MAX_SIZE) insert_ql(free_block);
-    else insert_ml(free_block);
+/**
+ * @brief Drops everything in the calling thread's cache once sf_mem_fini() released the heap range it came from
+ */
+void tcache_reset() {
+    for(int i = 0; i < NUM_QUICK_LISTS; i++) tcache.bins[i] = (struct sf_quick_list){0};
+    for(int i = 0; i < SLAB_CLASSES; i++) tcache.slab_bins[i] = (struct sf_slab_bin){0};
+    for(int i = 0; i < SF_MAX_ARENAS; i++) tcache.deltas[i] = (struct sf_delta){0};
+    tcache.generation = __atomic_load_n(&sf_mem_generation, __ATOMIC_RELAXED);
+}
 
-    // update the running total by the negative
-    update_pl(-pl_size);
+/**
+ * @brief Makes sure tcache_destroy() runs when the calling thread exits
+ */
+void tcache_register() {
+    if(tcache.registered) return;
+    pthread_once(&tcache_once, tcache_create_key);
+    // Any non-NULL value works, it only has to be set for the destructor to run
+    pthread_setspecific(tcache_key, &tcache);
+    tcache.registered = 1;
 }
+
 /*
  * Resizes the memory pointed to by ptr to size bytes.
  *
@@ -190,6 +1736,21 @@ void *sf_realloc(void *pp, size_t rsize) {
         sf_free(pp);
         return NULL;
     }
+    // Slab objects can't be resized, only moved to another size class (or the heap)
+    if(sf_slab_index(pp) >= 0) {
+        size_t obj_size = SLAB_OF(pp) -> obj_size;
+        if(rsize <= obj_size && rsize > obj_size - 16) return pp;
+        return realloc_move(pp, rsize, obj_size);
+    }
+    // Mapped chunks are resized by the kernel, unless they become small enough for a heap or a slab
+    if(sf_heap_index(pp) < 0) {
+        if(wants_mmap(rsize)) {
+            void *ptr = mmap_realloc(pp, rsize);
+            if(PROFILING && ptr) sf_prof_realloc(pp, ptr, rsize);
+            return ptr;
+        }
+        return realloc_move(pp, rsize, OBF(MMAP_BASE(pp)[0]));
+    }
     // Grab header
     sf_header * hPtr = (sf_header *) ((char *)pp - MROW);
     sf_header header = (sf_header) OBF(*hPtr);
@@ -201,98 +1762,315 @@ void *sf_realloc(void *pp, size_t rsize) {
     // fflush(stdout);
     // Case 0: reallocating to same size (for some reason)
     if(rsize == pl_size) return pp;
-    
-    // Pointer to return
-    // char *ptr = NULL;
-    // Case 1: reallocating to larger size
-    if (pl_size < rsize) {
-        char *ptr = sf_malloc(rsize);
-        // Error handle, if ptr is NULL, just return NULL, sf_errno should be set by malloc
-        if(!ptr) return NULL;
-
-        // Else memcpy payload over (note that pp is the beginning address of the payload)
-        memcpy(ptr, pp, pl_size);
-
-        // Now free the old block 
-        sf_free(pp); 
-
-        // Update running total by difference
-        update_pl(rsize - pl_size);
-        // Return new pointer
-        return ptr; 
-    }
-    // Case 2: reallocating to smaller size
-    else {
-        // In this case, the existing block should be used and split
+    // Growing to a size that's mapped moves the block out of the heap instead (Case 3)
+    if(rsize > pl_size && wants_mmap(rsize)) return realloc_move(pp, rsize, pl_size);
+    // Size of the block the new payload needs, with padding (header + footer + padding)
+    size_t new_size = calc_block_size(rsize);
+
+    // The block is resized by the arena it belongs to, whichever thread calls this
+    sf_arena *arena = ARENA_OF(hPtr);
+    lock_arena(arena);
+    // Case 1: the block is already large enough, or becomes too large, so it's split in place.
+    // split_malloc_block() rewrites the header with the new payload size and frees the tail (if there is one)
+    // Case 2: reallocating to larger size, try to absorb the free block after this one
+    // (extending the heap first if this is the last block), so nothing has to be copied
+    sf_block *block = (new_size <= block_size) ? split_malloc_block(arena, (sf_block *)hPtr, new_size, rsize)
+                                               : grow_malloc_block(arena, (sf_block *)hPtr, new_size, rsize);
+    if (block) {
+        update_pl(arena, (long)rsize - (long)pl_size);
+        update_blocks(arena, (long)rsize - (long)pl_size, (long)GET_BLOCK_SIZE(OBF(block -> header)) - (long)block_size);
+        unlock_arena(arena);
+        if(PROFILING) sf_prof_realloc(pp, pp, rsize);
+        return pp;
+    }
+    unlock_arena(arena);
 
-        // Grab size with padding. rsize will be the payload size and block_size will be the total  block size with padding (header + footer + padding)
-        block_size = (rsize + 2 * MROW);
-        if(block_size % 16 != 0) block_size += 16 - (rsize % 16);
+    // Case 3: the block can't grow where it is, so move it
+    return realloc_move(pp, rsize, pl_size);
+}
 
-        // Now, simply pass block pointer (header pointer) to split_malloc_block method.
-        sf_block *block = split_malloc_block((sf_block *)hPtr, block_size, rsize);
-        
-        // Update running and max
-        update_pl(rsize - pl_size);
+/**
+ * @brief Moves a (validated) payload to a new allocation of rsize bytes, then frees it
+ * @param old_size, size of the payload that's there now
+ * @returns pointer to the new payload, NULL if it couldn't be allocated (sf_errno is set by sf_malloc, pp is untouched)
+ */
+void *realloc_move(void *pp, size_t rsize, size_t old_size) {
+    char *ptr = sf_malloc(rsize);
+    // Error handle, if ptr is NULL, just return NULL, sf_errno should be set by malloc
+    if(!ptr) return NULL;
 
-        // Set header and footer of free_block
-        char *ptr = (char*)block + MROW;
-        return ptr;
-    } 
+    // Else memcpy payload over (note that pp is the beginning address of the payload)
+    memcpy(ptr, pp, rsize < old_size ? rsize : old_size);
+
+    // Now free the old block, sf_malloc and sf_free already updated the running total
+    sf_free(pp);
+    return ptr;
 }
 /**
  * @brief returns total amount of internal fragmentation which is total amount of payload / total size of allocated blocks
+ * @note The totals are kept up to date as blocks are allocated and freed (see update_blocks()), so nothing is walked.
+ * Blocks other threads allocated or freed through their thread caches are only included once they flush their deltas.
  */
 double sf_fragmentation() {
-   // initialize total payload
-   size_t total_pl = 0;
-   // initialize total size
-   size_t total_size = 0;
-   
-    // iterate through the heap, first grab start of heap then get first block by adding 5 memory rows
-    sf_block *curBlock = (sf_block*)((char*)sf_mem_start() + 5 * MROW);
-    // Prologue so that while loop knows when to stop
-    sf_block *prologue = (sf_block*)((char*)sf_mem_end() - MROW);
-
-    while(curBlock != prologue) {
-        // printf("cur block in while\n");
-        // sf_show_block(curBlock);
-        // Grab header of cur block
-        sf_header header = OBF(curBlock -> header);
-        // grab block size
-        size_t block_size = GET_BLOCK_SIZE(header);
-        // grab allocation bit
-        int alloc = header & THIS_BLOCK_ALLOCATED;
-        // grab quicklist bit
-        int ql = header & IN_QUICK_LIST;
-
-        // Make sure it's not in quick list and is allocated
-        if(ql || !alloc) {
-            // go to next block
-            curBlock = (sf_block*)((char*) curBlock + block_size);
-            continue;
-        } 
-        // else add to total block and pl size
-        total_size += block_size;
-        size_t pl = GET_PL_SIZE(header);
-        total_pl += pl; 
-        // increment to next block
-        curBlock = (sf_block*)((char*) curBlock + block_size);
-    }
+    // The totals may still include the blocks of a released heap range
+    if(ARENAS_STALE) reset_arenas();
+    // Only the calling thread's own deltas are flushed, without locking arenas it has none for
+    flush_all_deltas();
+    // Mapped chunks are allocated blocks as well
+    long total_pl = __atomic_load_n(&alloc_pl, __ATOMIC_RELAXED) + __atomic_load_n(&mmapped_pl, __ATOMIC_RELAXED);
+    long total_size = __atomic_load_n(&alloc_size, __ATOMIC_RELAXED) + __atomic_load_n(&mmapped_size, __ATOMIC_RELAXED);
     // check if no allocated blocks were found, then return 0
-    if(!total_pl) {
+    if(total_pl <= 0 || total_size <= 0) {
         return 0.0;
     }
     // return ratio
     return (double) total_pl / total_size;
 }
-// Find maximum payload size, and then divide that by total heap size
+
+double sf_arena_fragmentation(int index) {
+    if(index < 0 || index >= SF_MAX_ARENAS) return 0.0;
+    sf_arena *arena = arenas + index;
+    lock_arena(arena);
+    long total_pl = arena -> alloc_pl;
+    long total_size = arena -> alloc_size;
+    unlock_arena(arena);
+
+    if(total_pl <= 0 || total_size <= 0) return 0.0;
+    return (double) total_pl / total_size;
+}
+
+// Find maximum payload size, and then divide that by total resident heap size
 // If heap size is 0, then return 0
 double sf_utilization() {
-    if(HEAP_SIZE() == 0) return 0.0;
+    size_t heap_size = 0;
+    for(int i = 0; i < SF_MAX_ARENAS; i++) {
+        // Taking the lock adds the calling thread's delta to the totals as well
+        lock_arena(arenas + i);
+        heap_size += HEAP_SIZE(arenas + i) + SLAB_AREA_SIZE(arenas + i) - arenas[i].trimmed;
+        unlock_arena(arenas + i);
+    }
+    // Mapped chunks count with what's mapped now, like the heaps (unmapping one is giving its pages back)
+    heap_size += __atomic_load_n(&mmapped_size, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&max_pl, __ATOMIC_RELAXED);
+
+    if(heap_size == 0) return 0.0;
+    return (double) peak / heap_size;    
+}
+
+double sf_arena_utilization(int index) {
+    if(index < 0 || index >= SF_MAX_ARENAS) return 0.0;
+    sf_arena *arena = arenas + index;
+    lock_arena(arena);
+    size_t heap_size = HEAP_SIZE(arena) + SLAB_AREA_SIZE(arena) - arena -> trimmed;
+    long peak = arena -> max_pl;
+    unlock_arena(arena);
+
+    if(heap_size == 0) return 0.0;
+    return (double) peak / heap_size;
+}
+
+/*
+ * Trimming (see sf_trim()): the pages released inside a free block are recorded in the payload size field of its
+ * header and footer, which is otherwise unused in a free block, so each arena knows how much of its heap isn't
+ * resident. The count is dropped from the arena's total as soon as the block leaves its list (unlink_block()),
+ * since it's then about to be rewritten. Pages that are still released after that only make the total an
+ * overestimate of what's resident.
+ */
+
+size_t sf_trim(size_t pad) {
+    size_t released = 0;
+    for(int i = 0; i < SF_MAX_ARENAS; i++) {
+        sf_arena *arena = arenas + i;
+        lock_arena(arena);
+        if(HEAP_SIZE(arena)) {
+            released += trim_heap(arena, pad);
+            // Release what's inside every other free block large enough to hold a whole page (huge page with SF_HUGE_PAGES)
+            for(int index = get_ml_index(HEAP_UNIT); index < NUM_FREE_LISTS; index++) {
+                sf_block *sentinel = arena -> free_list_heads + index;
+                for(sf_block *cur = sentinel -> body.links.next; cur != sentinel; cur = cur -> body.links.next)
+                    released += trim_block(arena, cur);
+            }
+        }
+        unlock_arena(arena);
+    }
+    return released;
+}
 
-    size_t heap_size = HEAP_SIZE();
-    return (double) max_pl / heap_size;    
+/**
+ * @brief Shrinks the arena's heap if its last block is free, leaving at least pad bytes of that block
+ * @note Must be called with the arena's lock held, and the heap must be initialized
+ * @returns the number of bytes removed from the heap
+ */
+size_t trim_heap(sf_arena *arena, size_t pad) {
+    // The epilogue says whether the last block is free, and if it is, the row before the epilogue is its footer
+    sf_header *epilogue = (sf_header *)(HEAP_END(arena) - EPILOGUE_SIZE);
+    if(PREV_ALLOC(OBF(*epilogue))) return 0;
+    size_t block_size = GET_BLOCK_SIZE(OBF(*(epilogue - 1)));
+    sf_block *last = (sf_block *)((char *)epilogue - block_size);
+
+    // Whole units (pages, or huge pages) past the pad can go, as long as what's left is either nothing or a valid
+    // block. The heap end stays aligned to HEAP_UNIT, and never reaches the first unit, which holds the prologue.
+    size_t release = block_size > pad ? (block_size - pad) / HEAP_UNIT * HEAP_UNIT : 0;
+    size_t remaining = block_size - release;
+    if(remaining > 0 && remaining < MIN_BLOCK_SIZE) {
+        release -= HEAP_UNIT;
+        remaining += HEAP_UNIT;
+    }
+    if(release == 0) return 0;
+
+    // Unlinked first, the links may be in the pages that are removed
+    unlink_block(arena, last);
+    sf_header last_header = OBF(last -> header);
+    if(!sf_heap_shrink_n(ARENA_INDEX(arena), release / PAGE_SZ)) {
+        // The block goes back as it was, released pages included, which unlink_block() stopped counting
+        arena -> trimmed += GET_PL_SIZE(last_header) * PAGE_SZ;
+        insert_ml(arena, last);
+        return 0;
+    }
+
+    // New epilogue, followed by what's left of the block (which takes over its previous-allocated bit)
+    epilogue = (sf_header *)(HEAP_END(arena) - EPILOGUE_SIZE);
+    *epilogue = OBF(THIS_BLOCK_ALLOCATED | (remaining ? 0 : PREV_ALLOC(last_header)));
+    if(remaining) insert_ml(arena, create_free_block(remaining, (char *)last));
+    return release;
+}
+
+/**
+ * @brief Releases the whole pages inside a free block (past its links and before its footer), unless that was
+ * already done since the block was last rewritten, and records how many there are in its header and footer.
+ * With SF_HUGE_PAGES, only whole huge pages are released, releasing part of one would split it.
+ * @note Must be called with the arena's lock held, the block stays in its list
+ * @returns the number of bytes released
+ */
+size_t trim_block(sf_arena *arena, sf_block *block) {
+    sf_header header = OBF(block -> header);
+    if(GET_PL_SIZE(header)) return 0;
+
+    size_t block_size = GET_BLOCK_SIZE(header);
+    char *start = (char *)(((size_t)block + 3 * MROW + HEAP_UNIT - 1) & ~(HEAP_UNIT - 1));
+    char *end = (char *)(((size_t)block + block_size - MROW) & ~(HEAP_UNIT - 1));
+    if(end <= start || madvise(start, end - start, MADV_DONTNEED)) return 0;
+
+    size_t npages = (end - start) / PAGE_SZ;
+    set_header(block, PACK(npages, block_size, 0, 0));
+    arena -> trimmed += npages * PAGE_SZ;
+    return end - start;
+}
+
+/**
+ * @brief Returns whether no arena has initialized its heap yet
+ */
+int heaps_empty() {
+    for(int i = 0; i < SF_MAX_ARENAS; i++) {
+        if(arena_used(arenas + i)) return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Empties every arena once sf_mem_fini() released the heap range, so each heap starts over the next time it's
+ * used, along with the statistics across arenas (mapped chunks aren't in the range, they still count)
+ * @note Takes every arena's lock, so it must be called without holding any
+ */
+void reset_arenas() {
+    for(int i = 0; i < SF_MAX_ARENAS; i++) pthread_mutex_lock(&arenas[i].lock);
+    unsigned long generation = __atomic_load_n(&sf_mem_generation, __ATOMIC_RELAXED);
+    // Another thread may have done it while this one waited for the locks
+    if(arenas_generation != generation) {
+        for(int i = 0; i < SF_MAX_ARENAS; i++) {
+            sf_arena *arena = arenas + i;
+            initialize_free_lists(arena);
+            for(int j = 0; j < NUM_QUICK_LISTS; j++) arena -> quick_lists[j].first = NULL;
+            arena -> running_pl = arena -> max_pl = 0;
+            arena -> alloc_pl = arena -> alloc_size = 0;
+            arena -> remote_frees = NULL;
+            // The slab pages went with the range, sf_slab_end() starts over from sf_slab_start()
+            for(int j = 0; j < SLAB_CLASSES; j++) arena -> slabs[j] = NULL;
+            arena -> empty_slabs = NULL;
+            arena -> remote_slab_frees = NULL;
+            arena -> trimmed = 0;
+            arena -> fresh = NULL;
+        }
+        long pl = __atomic_load_n(&mmapped_pl, __ATOMIC_RELAXED);
+        __atomic_store_n(&running_pl, pl, __ATOMIC_RELAXED);
+        __atomic_store_n(&max_pl, pl, __ATOMIC_RELAXED);
+        __atomic_store_n(&alloc_pl, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&alloc_size, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&arenas_generation, generation, __ATOMIC_RELEASE);
+    }
+    for(int i = SF_MAX_ARENAS - 1; i >= 0; i--) pthread_mutex_unlock(&arenas[i].lock);
+}
+
+int sf_set_arenas(int count, sf_arena_mode mode) {
+    int ret = -1;
+    // Holding arena 0's lock keeps this from racing with another sf_set_arenas() call
+    pthread_mutex_lock(&arenas[0].lock);
+    // Threads may already have been handed an arena, so it can only change before anything is allocated
+    if(heaps_empty() && !thread_arena && count >= 1 && count <= SF_MAX_ARENAS &&
+       (mode == SF_ARENA_ROUND_ROBIN || mode == SF_ARENA_BY_CPU)) {
+        arena_count = count;
+        arena_mode = mode;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&arenas[0].lock);
+    if(ret) sf_errno = EINVAL;
+    return ret;
+}
+
+/*
+ * Fork handlers: the forking thread holds every arena's lock (and the profiler's and the mapped chunk registry's)
+ * while the process is copied, so the child never inherits a lock some other thread held in the middle of an update.
+ * Nothing takes an arena lock while holding another, so taking them all in index order can't deadlock.
+ */
+
+void sf_fork_prepare() {
+    for(int i = 0; i < SF_MAX_ARENAS; i++) pthread_mutex_lock(&arenas[i].lock);
+    sf_prof_fork_lock();
+    pthread_mutex_lock(&mmap_lock);
+}
+
+void sf_fork_parent() {
+    pthread_mutex_unlock(&mmap_lock);
+    sf_prof_fork_unlock();
+    for(int i = SF_MAX_ARENAS - 1; i >= 0; i--) pthread_mutex_unlock(&arenas[i].lock);
+}
+
+void sf_fork_child() {
+    // The child's only thread is the one that took the locks, so they're released the same way
+    sf_fork_parent();
+}
+
+int sf_arena_count() {
+    pthread_once(&arenas_once, init_arenas);
+    return arena_count;
+}
+
+int sf_set_policy(sf_fit_policy policy) {
+    pthread_mutex_lock(&arenas[0].lock);
+    // The lists may already hold blocks in an order the new policy doesn't expect
+    int ret = -1;
+    if(heaps_empty() && policy >= SF_FIT_GOOD && policy <= SF_FIT_NEXT) {
+        fit_policy = policy;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&arenas[0].lock);
+    if(ret) sf_errno = EINVAL;
+    return ret;
+}
+
+sf_fit_policy sf_get_policy() {
+    return fit_policy;
+}
+
+const char *sf_policy_name(sf_fit_policy policy) {
+    switch(policy) {
+        case SF_FIT_GOOD: return "good";
+        case SF_FIT_FIRST: return "first";
+        case SF_FIT_BEST: return "best";
+        case SF_FIT_ADDRESS: return "address";
+        case SF_FIT_NEXT: return "next";
+    }
+    return "unknown";
 }
 /**
  * @brief Helper function which creates an alloacted block from a given free block
@@ -305,13 +2083,8 @@ void *create_malloc_block(sf_block* free_block, size_t pl_size) {
     // Grab free_block block_size
     size_t block_size = GET_BLOCK_SIZE(OBF(free_block -> header));
 
-    // Grab footer of free block
-    sf_footer *fPtr = FOOTER(free_block);
-
-    // Pack header with corresponding values
-    free_block -> header = OBF(PACK(pl_size, block_size, 0, 1));
-    // Pack footer with same values
-    *fPtr = free_block -> header;
+    // Pack header (and footer) with corresponding values
+    set_header(free_block, PACK(pl_size, block_size, 0, 1));
 
     // Return pointer to payload
     return (void *) ((char*)free_block + MROW);
@@ -330,8 +2103,20 @@ int validate_pp(void *pp) {
     // Way to check: make sure starting address is multiple of 16
     if((size_t)pp % 16 != 0) return  -1; 
 
-    // Now grab header and unobfuscate to compare
+    // Slab objects are checked against their slab instead
+    int slab = sf_slab_index(pp);
+    if(slab >= 0) return validate_slab_pp(pp, slab);
+
+    // Is it outside of every arena's heap? Then it can only be a mapped chunk
     sf_header * hPtr = (sf_header*) ((char*) pp - MROW);
+    int heap = sf_heap_index(hPtr);
+    if(heap < 0) return validate_mmap_pp(pp);
+    sf_arena *arena = arenas + heap;
+
+    // is the header before the first block or past the last one (possibly not even mapped), then invalid
+    if((char *)hPtr < HEAP_START(arena) + 5 * MROW || (char *)hPtr >= HEAP_END(arena) - MROW) return -1;
+
+    // Now grab header and unobfuscate to compare
     // XOR
     sf_header header = (sf_header)OBF(*hPtr);
     // grab block size
@@ -339,13 +2124,11 @@ int validate_pp(void *pp) {
     
     // is it less than 32 block size or not a multiple of 16, then invalid
     if(block_size < MIN_BLOCK_SIZE || block_size % 16 != 0) return -1; 
-    // is the header before the start of the heap
-    if((size_t)hPtr < (size_t)sf_mem_start()) return -1;
 
     // grab footer
-    sf_footer* fPtr = (sf_footer *)((char*) header + block_size - MROW);
+    sf_footer* fPtr = (sf_footer *)((char*) hPtr + block_size - MROW);
     // is footer after the end of the heap
-    if((size_t)fPtr > (size_t)sf_mem_end()) return -1;
+    if((char *)fPtr >= HEAP_END(arena) - MROW) return -1;
 
     // grab alloc bit
     int alloc = header & THIS_BLOCK_ALLOCATED;
@@ -365,7 +2148,7 @@ int validate_pp(void *pp) {
  * @invariant free_block should not be present in the main list. 
  * And it will always be a main list free block, not a quick list one
  */
-sf_block* split_free_block(sf_block* free_block, size_t block_size) {
+sf_block* split_free_block(sf_arena *arena, sf_block* free_block, size_t block_size) {
     size_t fb_size = GET_BLOCK_SIZE(OBF(free_block -> header));
     size_t frag_size = fb_size - block_size;
     // Check if a fragment would be made, in which case free_block is returned as is
@@ -374,20 +2157,18 @@ sf_block* split_free_block(sf_block* free_block, size_t block_size) {
     }
     
     // Otherwise, continue splitting
-    // Add new header information to beginning of block
-    free_block -> header = OBF(PACK(0, block_size, 0, 0));
-    // Add footer information
-    sf_footer *footer = (sf_footer *) ((char *)free_block + block_size - MROW);
-    *footer = free_block -> header; 
-
     // Grab pointer to where the next block (split one) should be stored
     char *nxtPtr = (char *) free_block + block_size;
-    // Create free block starting at that address
+    // Create free block starting at that address, it follows a free block until this one is allocated
+    ((sf_block *)nxtPtr) -> header = OBF(0);
     sf_block *fragment = create_free_block(frag_size, nxtPtr);
 
+    // Add new header (and footer) information to beginning of block
+    set_header(free_block, PACK(0, block_size, 0, 0));
+
     // Insert fragment into main list, no point inserting into quick list since that will
     // most likely be popped from soon. 
-    insert_ml(fragment);
+    insert_ml(arena, fragment);
 
     // Then return the newly split block
     return free_block;
@@ -395,108 +2176,252 @@ sf_block* split_free_block(sf_block* free_block, size_t block_size) {
 /**
  * @brief Very similar to split_free_block, but this takes in an allocated block and splits it as needed.
  * Intended for sf_realloc() to call. The only difference between this and split_free_block is that this one coalesces.
+ * The header is rewritten with the new payload size even if the block isn't split.
  * @param block, pointer to block header (NOT PAYLOAD)
  * @param block_size, size to split into
  * @param pl_size, payload size
  * @returns block, pointer to the header of the split block
  */
-sf_block* split_malloc_block(sf_block* block, size_t block_size, size_t pl_size) {
+sf_block* split_malloc_block(sf_arena *arena, sf_block* block, size_t block_size, size_t pl_size) {
     size_t b_size = GET_BLOCK_SIZE(OBF(block -> header));
     size_t frag_size = b_size - block_size;
-    // Check if a fragment would be made, in which case free_block is returned as is
+    // Check if a fragment would be made, in which case the block keeps its size
     if(frag_size < MIN_BLOCK_SIZE) {
-        return block;
+        block_size = b_size;
     }
     
-    // Otherwise, continue splitting
-    // Add new header information to beginning of block
-    block -> header = OBF(PACK(pl_size, block_size, 0, 1));
-    // Add footer information
-    sf_footer *footer = (sf_footer *) ((char *)block + block_size - MROW);
-    *footer = block -> header; 
+    if(block_size == b_size) {
+        set_header(block, PACK(pl_size, block_size, 0, 1));
+        return block;
+    }
 
+    // Otherwise, continue splitting
     // Grab pointer to where the next block (split one) should be stored
     char *nxtPtr = (char *) block + block_size;
-    // Create free block starting at that address
+    // Create free block starting at that address (before the header is rewritten, so the block after
+    // this one is always a valid block)
+    ((sf_block *)nxtPtr) -> header = OBF(PREV_BLOCK_ALLOCATED);
     sf_block *fragment = create_free_block(frag_size, nxtPtr);
 
+    // Add new header information to beginning of block
+    set_header(block, PACK(pl_size, block_size, 0, 1));
+
     // Coalesce as needed
-    coalesce(fragment);
+    fragment = coalesce(arena, fragment);
 
     // Insert fragment into main list, no point inserting into quick list since that will
     // most likely be popped from soon. 
-    insert_ml(fragment);
+    insert_ml(arena, fragment);
 
     // Then return the newly split block
     return block;
 }
 
+/**
+ * @brief Grows an allocated block in place, for sf_realloc(). The free block right after it is absorbed, and if
+ * the block (or that free block) is the last one in the heap, the heap is extended first so the rest fits.
+ * Anything left over is split off again by split_malloc_block().
+ * @param block, pointer to block header (NOT PAYLOAD)
+ * @param block_size, size the block needs to grow to
+ * @param pl_size, new payload size
+ * @returns block on success, NULL if the block can't grow in place (the heap is unchanged in that case)
+ */
+sf_block *grow_malloc_block(sf_arena *arena, sf_block *block, size_t block_size, size_t pl_size) {
+    size_t b_size = GET_BLOCK_SIZE(OBF(block -> header));
+    // Last block that can be merged into this one, and the total size that's available
+    sf_block *last = block;
+    size_t avail = b_size;
+
+    sf_block *next = NEXT_BLOCK(block);
+    sf_header nextHdr = OBF(next -> header);
+    if(!(nextHdr & THIS_BLOCK_ALLOCATED)) {
+        last = next;
+        avail += GET_BLOCK_SIZE(nextHdr);
+    }
+
+    if(avail < block_size) {
+        // Only the end of the heap can be made larger
+        if((char *)NEXT_BLOCK(last) != HEAP_END(arena) - EPILOGUE_SIZE) return NULL;
+        // sf_realloc falls back to sf_malloc if this fails, which sets sf_errno if it fails too
+        int saved_errno = sf_errno;
+        if(!extend_heap(arena, (block_size - avail + PAGE_SZ - 1) / PAGE_SZ)) {
+            sf_errno = saved_errno;
+            return NULL;
+        }
+        // The new pages were coalesced into a free block right after this one
+        next = NEXT_BLOCK(block);
+        nextHdr = OBF(next -> header);
+    }
+
+    // Absorb the free block after this one
+    unlink_block(arena, next);
+    set_header(block, PACK(pl_size, b_size + GET_BLOCK_SIZE(nextHdr), 0, 1));
+    mark_used(arena, (char *)NEXT_BLOCK(block));
+
+    // Give back whatever isn't needed
+    return split_malloc_block(arena, block, block_size, pl_size);
+}
+
 /**
  * @brief: Simple helper function to abstract "unlinking" code. 
  * Unlinks the block passed in from its "prev" and "next" free blocks
- * @param block: pointer to block to unlilnk
+ * If that empties its list, the list's bits are cleared from the bitmaps
+ * @param block: pointer to block to unlilnk (its header must still hold its size and released page count)
  */
-void unlink_block(sf_block *block) {
+void unlink_block(sf_arena *arena, sf_block *block) {
     sf_block *prev = block -> body.links.prev;
     sf_block *next = block -> body.links.next;
+    // The block is about to be used or rewritten, so its released pages are counted as resident again
+    arena -> trimmed -= GET_PL_SIZE(OBF(block -> header)) * PAGE_SZ;
     
     block -> body.links.next = NULL;
     block -> body.links.prev = NULL;
 
     prev -> body.links.next = next;
     next -> body.links.prev = prev;
+
+    // Only the sentinel is left when prev and next are the same block
+    if(prev == next || fit_policy == SF_FIT_NEXT) {
+        int index = get_ml_index(GET_BLOCK_SIZE(OBF(block -> header)));
+        // Move the rover off the block that's leaving the list
+        if(arena -> rovers[index] == block) arena -> rovers[index] = next;
+        if(prev == next && prev == arena -> free_list_heads + index) {
+            int fl = index / SL_COUNT;
+            arena -> sl_bitmap[fl] &= ~(1U << (index % SL_COUNT));
+            if(!arena -> sl_bitmap[fl]) arena -> fl_bitmap &= ~(1U << fl);
+        }
+    }
 }
 /**
- * @brief: Finds a block for the given block size
+ * @brief: Finds a block for the given block size, according to the placement policy
+ * SF_FIT_GOOD rounds the size up to the next list boundary first, so that the first block of the list found is
+ * always large enough. Finding that list only takes two bit scans over the bitmaps.
+ * The other policies search the request's own list (the only one that can hold blocks too small), and then
+ * fall back to the next non-empty list, where every block fits.
  * @param block_size: size to find corresponding block for
  * @returns block of free memory if found, NULL if not
  */
-sf_block* find_fit(size_t block_size) {
-    // printf("finding fit of size: %zu", block_size);
-    // Get index of ML to search first
+sf_block* find_fit(sf_arena *arena, size_t block_size) {
     int index = get_ml_index(block_size);
-    // printf("Index: %d", index);
-    // variable to store size of current block (used for comparing with size parameter)
-    size_t curSize;
-   
-   // Iterate through each free list to find one
-   for (int i = index; i < NUM_FREE_LISTS; i++) {
-        // grab head of list
-        sf_block *sentinel = sf_free_list_heads + i;
-        sf_block *cur = sentinel;
-
-        // Iterate through until a large enough block is found
-        do {
-            cur = cur -> body.links.next;
-            // Grab current block size
-            curSize = GET_BLOCK_SIZE(OBF(cur -> header)); 
-        } while(cur != sentinel && curSize < block_size);
-
-        // printf("out of while loop with cursize: %zu\n", curSize);
-        if(cur != sentinel && curSize >= block_size) {
-            // Return cur
-            // printf("in cursize >= block_size with index: %d\n", i);
-            return cur;
-        } 
-   }
+    sf_block *fit = NULL;
+
+    switch(fit_policy) {
+        case SF_FIT_GOOD: {
+            // Round up so every block in the list at the resulting index fits
+            size_t size = block_size;
+            if(size >= SMALL_BLOCK_SIZE) size += ((size_t)1 << (FLS(size) - SL_LOG2)) - 1;
+            int good = find_nonempty_list(arena, get_ml_index(size));
+            if(good >= 0) return arena -> free_list_heads[good].body.links.next;
+
+            // Rounding up skips the list the size itself maps to, which can still hold a block that fits.
+            // Check it before giving up so the heap isn't grown when it doesn't have to be.
+            return first_fit_in_list(arena, index, block_size);
+        }
+        case SF_FIT_BEST:
+            fit = best_fit_in_list(arena, index, block_size);
+            if(fit) return fit;
+            // Every block in a larger list fits, but the smallest one should still be taken
+            index = find_nonempty_list(arena, index + 1);
+            return index < 0 ? NULL : best_fit_in_list(arena, index, block_size);
+        case SF_FIT_NEXT:
+            fit = next_fit_in_list(arena, index, block_size);
+            if(fit) return fit;
+            index = find_nonempty_list(arena, index + 1);
+            return index < 0 ? NULL : next_fit_in_list(arena, index, block_size);
+        default:
+            // SF_FIT_FIRST, and SF_FIT_ADDRESS where the lists are sorted so first fit is the lowest address
+            fit = first_fit_in_list(arena, index, block_size);
+            if(fit) return fit;
+            index = find_nonempty_list(arena, index + 1);
+            return index < 0 ? NULL : arena -> free_list_heads[index].body.links.next;
+    }
+}
+
+/**
+ * @brief: Finds the smallest non-empty free list at or above the given index using the bitmaps
+ * @param index: index of the first list to consider
+ * @returns index of the list, -1 if every list from index up is empty
+ */
+int find_nonempty_list(sf_arena *arena, int index) {
+    if(index >= NUM_FREE_LISTS) return -1;
+
+    // Non-empty lists in the same first-level class that are at least as large
+    int fl = index / SL_COUNT;
+    uint32_t sl_map = arena -> sl_bitmap[fl] & (~0U << (index % SL_COUNT));
+    if(!sl_map) {
+        // Otherwise take the smallest non-empty first-level class above
+        uint32_t fl_map = (fl + 1 < FL_COUNT) ? arena -> fl_bitmap & (~0U << (fl + 1)) : 0;
+        if(!fl_map) return -1;
+        fl = __builtin_ctz(fl_map);
+        sl_map = arena -> sl_bitmap[fl];
+    }
+    return fl * SL_COUNT + __builtin_ctz(sl_map);
+}
+
+/**
+ * @brief: Returns the first block in the list at index that is at least block_size
+ */
+sf_block *first_fit_in_list(sf_arena *arena, int index, size_t block_size) {
+    if(index >= NUM_FREE_LISTS) return NULL;
+    sf_block *sentinel = arena -> free_list_heads + index;
+    for(sf_block *cur = sentinel -> body.links.next; cur != sentinel; cur = cur -> body.links.next) {
+        if(GET_BLOCK_SIZE(OBF(cur -> header)) >= block_size) return cur;
+    }
+    return NULL;
+}
+
+/**
+ * @brief: Returns the smallest block in the list at index that is at least block_size (stops early on an exact fit)
+ */
+sf_block *best_fit_in_list(sf_arena *arena, int index, size_t block_size) {
+    if(index >= NUM_FREE_LISTS) return NULL;
+    sf_block *sentinel = arena -> free_list_heads + index;
+    sf_block *best = NULL;
+    size_t best_size = 0;
+    for(sf_block *cur = sentinel -> body.links.next; cur != sentinel; cur = cur -> body.links.next) {
+        size_t cur_size = GET_BLOCK_SIZE(OBF(cur -> header));
+        if(cur_size < block_size || (best && cur_size >= best_size)) continue;
+        best = cur;
+        best_size = cur_size;
+        if(cur_size == block_size) break;
+    }
+    return best;
+}
 
-   // Else, no valid block was found, return NULL
-   return NULL;
+/**
+ * @brief: First fit in the list at index, starting from its roving pointer and wrapping around once.
+ * The rover is left on the block found, unlink_block() then moves it on to the block after.
+ */
+sf_block *next_fit_in_list(sf_arena *arena, int index, size_t block_size) {
+    if(index >= NUM_FREE_LISTS) return NULL;
+    sf_block *sentinel = arena -> free_list_heads + index;
+    sf_block *start = arena -> rovers[index];
+    sf_block *cur = start;
+    do {
+        if(cur != sentinel && GET_BLOCK_SIZE(OBF(cur -> header)) >= block_size) {
+            arena -> rovers[index] = cur;
+            return cur;
+        }
+        cur = cur -> body.links.next;
+    } while(cur != start);
+    return NULL;
 }
+
 /**
  * @brief Pops a block from the QL index
  * @param index, index of QL ot pop from
  */
-sf_block* popQL(int index) {
+sf_block* popQL(sf_arena *arena, int index) {
     // Grab first pointer thing
-    sf_block *first = sf_quick_lists[index].first;
+    sf_block *first = arena -> quick_lists[index].first;
     // Error checking
     if(!first) return NULL;
 
     // "Pop" first from list
-    sf_quick_lists[index].first = first -> body.links.next;
+    arena -> quick_lists[index].first = first -> body.links.next;
     // decrease length
-    sf_quick_lists[index].length--; 
+    arena -> quick_lists[index].length--; 
+    arena -> ql_pops[index]++;
 
     // Unlink it
     first -> body.links.next = NULL;
@@ -504,13 +2429,25 @@ sf_block* popQL(int index) {
     return first;        
 }
 
+/**
+ * @brief Reads the obfuscation key from sf_magic(), runs once before the first heap is initialized
+ */
+void load_obf_key() {
+    // The magic number is picked along with the heap range, which may not be reserved yet this early
+    sf_mem_init();
+    obf_key = sf_magic();
+}
+
 /**
  * @brief Initializes heap with the initial prologue value.
 * @returns 0 on success, -1 on failure
 */
-int initialize_heap() {
+int initialize_heap(sf_arena *arena) {
+    // Every heap is obfuscated with the same key, which can't change once a heap holds blocks
+    pthread_once(&obf_once, load_obf_key);
+
     // Grow heap, handling error
-    char *ret = sf_mem_grow();   
+    char *ret = sf_heap_grow_n(ARENA_INDEX(arena), HEAP_UNIT / PAGE_SZ);
     if (!ret) {
         sf_errno = ENOMEM;
         return -1;
@@ -518,7 +2455,7 @@ int initialize_heap() {
     
     // Initialize with prologue and epilogue
     // offset by one memory row, since first memory row is unused
-    sf_block *prologue = (sf_block *)(sf_mem_start() + MROW);
+    sf_block *prologue = (sf_block *)(HEAP_START(arena) + MROW);
     // Initialize with payload size  (0), block size (4  * MROW), 0 for QL alloc bit, and 1 for alloc bit
     sf_header prologue_header = OBF(PACK(0, 4 * MROW, 0, 1)); 
     
@@ -530,97 +2467,170 @@ int initialize_heap() {
     // Replicate header to footer
     *footer = prologue -> header;
 
-    // Initialize first free block
-    // Subtract epilogue and prologue size from the total heap (along with the unused memory row at the beginning
-    size_t block_size = 4096 - EPILOGUE_SIZE - PROLOGUE_SIZE - MROW;
-    // 2 * MROW represents total size of header and footer
-    sf_block *free_block = (sf_block*)create_free_block(block_size, ((char*) prologue + 4 * MROW));
+    // Initialize epilogue first, this should just be a header with only the allocation bit set (hopefully)
+    // The first free block below updates its previous-allocated bit
+    sf_header *epilogue = (sf_header *)(HEAP_END(arena) - MROW);
+    *epilogue = OBF(THIS_BLOCK_ALLOCATED);
 
-    // Initialize epilogue, this should just be a header with only the allocation bit set (hopefully)
-    sf_header *epilogue = (sf_header *)NEXT_BLOCK(free_block);
-    *epilogue = OBF(0x0000000000000001);
+    // Initialize first free block, which follows the (allocated) prologue
+    // Subtract epilogue and prologue size from the total heap (along with the unused memory row at the beginning
+    size_t block_size = HEAP_UNIT - EPILOGUE_SIZE - PROLOGUE_SIZE - MROW;
+    char *first = (char *) prologue + 4 * MROW;
+    ((sf_block *)first) -> header = OBF(PREV_BLOCK_ALLOCATED);
+    sf_block *free_block = (sf_block*)create_free_block(block_size, first);
 
     // Insert free block into the main list
-    insert_ml(free_block);
+    insert_ml(arena, free_block);
+    // Nothing has been taken from the heap's pages yet (they're new, even after sf_mem_fini())
+    arena -> fresh = HEAP_START(arena);
     return 0; // Return 0 on completion
 }
 
 /**
- * @brief extend the heap and coalesce the block if needed
- * @returns 0 on success, -1 on failure
+ * @brief extend the heap by npages pages in a single sf_heap_grow_n() call and coalesce the new block if needed
+ * @param npages, number of pages to add to the heap
+ * @returns the coalesced free block (already inserted into the main list) on success, NULL on failure
  */
-int extend_heap() {
+sf_block *extend_heap(sf_arena *arena, size_t npages) {
+    // Round up so the heap still ends on a HEAP_UNIT boundary
+    size_t grown = (size_t)HEAP_SIZE(arena) + npages * PAGE_SZ;
+    npages += ((grown + HEAP_UNIT - 1) / HEAP_UNIT * HEAP_UNIT - grown) / PAGE_SZ;
     // Grow heap, handling error
-    char *ret = sf_mem_grow();   
+    char *ret = sf_heap_grow_n(ARENA_INDEX(arena), npages);   
     if (!ret) {
         sf_errno = ENOMEM;
-        return -1;
+        return NULL;
     }  
 
-    // Initialize the free block header & footer, this will start where the previous epilogue was 
-    sf_block *free_block = create_free_block(PAGE_SZ, (ret - MROW));
-
-    // Set epilogue
+    // Set epilogue first, so the new free block is followed by a valid block
     // Grab last mem address offset by one row to insert epilogue
-    char *end = (char *)sf_mem_end() - MROW;
+    char *end = HEAP_END(arena) - MROW;
     sf_header *epilogue = (sf_header*) (end);
-    *epilogue = OBF(0x0000000000000001);
+    *epilogue = OBF(THIS_BLOCK_ALLOCATED);
 
-    // Coalesce free_block
-    free_block = coalesce(free_block);
+    // Initialize the free block header & footer, this will start where the previous epilogue was 
+    // (and keeps its previous-allocated bit)
+    sf_block *free_block = create_free_block(npages * PAGE_SZ, (ret - MROW));
+
+    // Coalesce free_block. If it merges with the last block, the old epilogue and the footer before it are cleared
+    // instead of counting as used, so the fresh part doesn't have to start at the old end of the heap
+    char *fresh = arena -> fresh;
+    sf_block *merged = coalesce(arena, free_block);
+    if(merged != free_block) {
+        ((sf_header *)ret)[-2] = 0;
+        ((sf_header *)ret)[-1] = 0;
+        arena -> fresh = fresh;
+    }
+    free_block = merged;
     // Insert coalesced block into main list
-    insert_ml(free_block);
+    insert_ml(arena, free_block);
     
-    return 0;
+    return free_block;
+}
+
+/**
+ * @brief Computes how many pages extend_heap() needs to add so that a block of block_size fits
+ * @param block_size, size of the block that has to fit
+ * @returns number of pages, at least 1
+ * @note If the last block of the heap is free, it will coalesce with the new pages, so only the difference is needed
+ */
+size_t pages_needed(sf_arena *arena, size_t block_size) {
+    // The epilogue says whether the last block is free, and if it is, the row before the epilogue is its footer
+    sf_header epilogue = OBF(*(sf_header *)(HEAP_END(arena) - EPILOGUE_SIZE));
+    size_t last_free = 0;
+    if(!PREV_ALLOC(epilogue)) last_free = GET_BLOCK_SIZE(OBF(*(sf_footer *)(HEAP_END(arena) - EPILOGUE_SIZE - MROW)));
+
+    size_t missing = block_size > last_free ? block_size - last_free : 0;
+    size_t npages = (missing + PAGE_SZ - 1) / PAGE_SZ;
+    return npages ? npages : 1;
 }
 
 /* 
  * @brief Return index of corresponding free list based on size
+ * The first level is the power-of-two class of the size, the second level is the next SL_LOG2 bits below the
+ * leading one. Sizes below SMALL_BLOCK_SIZE are all first level 0 and are indexed by size / 16 directly.
  * Note: fl = free list
 **/
 int get_ml_index(size_t size) {
-    size_t m = 32; // Minimum size
-
-    for(int i = 0; i < NUM_FREE_LISTS-1; i++) {
-        if(size <= m) return i;
-        m =  m << 1; // Bitwise left by 1 (to multiply by 2)
-    }
+    if(size < SMALL_BLOCK_SIZE) return size / 16;
 
-    return NUM_FREE_LISTS - 1;
+    int log2 = FLS(size);
+    int fl = log2 - FLS(SMALL_BLOCK_SIZE) + 1;
+    int sl = (size >> (log2 - SL_LOG2)) - SL_COUNT;
+    return fl * SL_COUNT + sl;
 }
 
 /**
 * @brief Creates a free block of the given size, starting at the given address
 * @param block_size, size of the free block, including header, footer, & padding !IMPORTANT
 * @param start_addr, starting address of the free block
+* @note The previous-allocated bit of the header already at start_addr is kept, and the block after the new one
+* has to be valid (see set_header())
 * */
 void *create_free_block(size_t block_size, char *start_addr) {
     sf_block *free_block = (sf_block*) start_addr;
 
-    // Initialize header of free block
-    free_block -> header = OBF(PACK(0, block_size, 0, 0));
-
-    // Initialize footer of free block
-    sf_footer* footer = (sf_footer*) ((char *) free_block + block_size - MROW);
-    *footer = free_block -> header;
+    // Initialize header and footer of free block
+    set_header(free_block, PACK(0, block_size, 0, 0));
     return (void *)free_block;
 }
+
+/**
+ * @brief Writes a block's header, and its footer unless the block is allocated and footers are elided.
+ * The block keeps its previous-allocated bit, and the previous-allocated bit of the block after it is updated to match.
+ * @param header, new (unobfuscated) header, its previous-allocated bit is ignored
+ * @note The block after this one (with its new size) has to have a valid header already
+ */
+void set_header(sf_block *block, sf_header header) {
+    header = (header & ~PREV_BLOCK_ALLOCATED) | PREV_ALLOC(OBF(block -> header));
+    block -> header = OBF(header);
+    if(!SF_FOOTER_ELISION || !(header & THIS_BLOCK_ALLOCATED)) *FOOTER(block) = block -> header;
+    set_prev_alloc(NEXT_BLOCK(block), header & THIS_BLOCK_ALLOCATED);
+}
+
+/**
+ * @brief Sets or clears the previous-allocated bit of a block (in its footer too if it's free)
+ * @note Must be called with the arena's lock held. If the block is allocated, the thread freeing it may be marking it
+ * at the same time without the lock (see flip_header_bits()), so the bit is flipped atomically.
+ */
+void set_prev_alloc(sf_block *block, int prev_alloc) {
+    sf_header header = OBF(block -> header);
+    if(!PREV_ALLOC(header) == !prev_alloc) return;
+    header = OBF(__atomic_xor_fetch(&block -> header, PREV_BLOCK_ALLOCATED, __ATOMIC_RELAXED));
+    if(!(header & THIS_BLOCK_ALLOCATED)) *FOOTER(block) = block -> header;
+}
+
+/**
+ * @brief Flips bits in the header of an allocated block that's being freed without the arena's lock
+ * (into a thread cache or a remote free stack), and copies the header to the footer unless footers are elided
+ * @note Only set_prev_alloc() can change the header at the same time, and it flips a different bit atomically too
+ * @param bits, (unobfuscated) bits to flip, their current values must be known
+ */
+void flip_header_bits(sf_block *block, sf_header bits) {
+    __atomic_xor_fetch(&block -> header, bits, __ATOMIC_RELAXED);
+    if(!SF_FOOTER_ELISION) *FOOTER(block) = block -> header;
+}
 /**
  * @brief Initialize both the main and quick free lists
  */
-void initialize_free_lists() {
+void initialize_free_lists(sf_arena *arena) {
     // First, go through quick list and initialize
     // Note: the "first" free block will be NULL, so check this when inserting into the quick list 
     for(int i = 0; i < NUM_QUICK_LISTS; i++) {
-        sf_quick_lists[i].length = 0;
+        arena -> quick_lists[i].length = 0;
+        arena -> ql_capacity[i] = QUICK_LIST_MAX;
+        arena -> ql_pops[i] = 0;
     }
 
     // Then, go through main list and initialize
+    arena -> fl_bitmap = 0;
+    for(int i = 0; i < FL_COUNT; i++) arena -> sl_bitmap[i] = 0;
     for (int i = 0; i < NUM_FREE_LISTS; i++) {
-        sf_block *cur = &sf_free_list_heads[i];
+        sf_block *cur = &arena -> free_list_heads[i];
         // Initialize next and prev values  
         cur -> body.links.next = cur;
         cur -> body.links.prev = cur;
+        arena -> rovers[i] = cur;
         // cur -> header = OBF((size_t)0);
     }
 }
@@ -628,40 +2638,45 @@ void initialize_free_lists() {
 * @brief Inserts the free block into the corresponding main list
 * @param free_block, pointer to the free block
 */
-void insert_ml(sf_block* free_block) {
+void insert_ml(sf_arena *arena, sf_block* free_block) {
     /// Grab block size
     size_t block_size = GET_BLOCK_SIZE(OBF(free_block -> header));
 
     //Grab index
     int index = get_ml_index(block_size);
     // Grab sentinel of respective list
-    sf_block *sentinel = (sf_free_list_heads + index);
+    sf_block *sentinel = (arena -> free_list_heads + index);
     
-    // Insert into list
+    // Insert into list, at the front (LIFO) unless the list is kept in address order
     sf_block *next = sentinel -> body.links.next;
-    sentinel -> body.links.next = free_block;
+    if(fit_policy == SF_FIT_ADDRESS) {
+        while(next != sentinel && next < free_block) next = next -> body.links.next;
+    }
+    sf_block *prev = next -> body.links.prev;
+    prev -> body.links.next = free_block;
     next ->  body.links.prev = free_block;
-    free_block -> body.links.prev = sentinel;
+    free_block -> body.links.prev = prev;
     free_block -> body.links.next = next;
 
+    // Mark the list (and its first-level class) as non-empty
+    arena -> sl_bitmap[index / SL_COUNT] |= 1U << (index % SL_COUNT);
+    arena -> fl_bitmap |= 1U << (index / SL_COUNT);
 }
 
 /**
  * @brief Removes the given free_block from the corresponding main free list
  * @param free_block, address of the free_block to remove
  * @returns 0 on success, -1 on failure (if the free_block is not found in the list)
- * @note, this function is kinda obselete since I can just call unlink_block() which is much more efficient. 
- * However, this function also tells me if a given block passed in can't be found in any free list. 
- * But I'm not sure that's an edge case I really need to check as every free block should be in a list
- * Something to just keep in mind.
+ * @note, this walks the whole list, so it's only used by detach_ml() in DEBUG builds to check that
+ * the block really is in its list. Everywhere else unlink_block() does the same thing in O(1).
  */
-int remove_ml(sf_block *free_block) {
+int remove_ml(sf_arena *arena, sf_block *free_block) {
     // Grab block size
     size_t block_size = GET_BLOCK_SIZE(OBF(free_block -> header));
     // Grab index
     int index = get_ml_index(block_size);
     // Grab sentinel
-    sf_block *sentinel = (sf_free_list_heads + index);
+    sf_block *sentinel = (arena -> free_list_heads + index);
 
     // Iterate until the free_block is found
     sf_block *cur = sentinel;
@@ -673,68 +2688,102 @@ int remove_ml(sf_block *free_block) {
     if(cur == sentinel) return -1;
 
     // Else, cur = free_block, so remove/unlink it
-    unlink_block(cur);
+    unlink_block(arena, cur);
 
     // Return 0 on success
     return 0;
 }
 /**
- * @brief Insert a free block into the corresponding quick list
- * @param free_block, pointer to the free block sf_block struct
+ * @brief Removes a free neighbour from its main list while coalescing.
+ * Since the block is doubly linked, it's unlinked directly through its own links in O(1).
+ * DEBUG builds go through remove_ml() instead, which also reports a block that isn't in its list.
+ * @param free_block, the free block to remove
+ * @param which, "next" or "prev", only used for the error message
+ */
+void detach_ml(sf_arena *arena, sf_block *free_block, const char *which) {
+#ifdef DEBUG
+    int ret = remove_ml(arena, free_block);
+    if(ret) fprintf(stderr, "Failed to find %s block to remove while coalescing\n", which);
+#else
+    (void) which;
+    unlink_block(arena, free_block);
+#endif
+}
+
+/**
+ * @brief Insert a block into the corresponding quick list
+ * @param block, pointer to the block, free or allocated (its payload size is dropped)
+ * @note The capacity of the list adapts to how it's used. When it's full, a list that had at least half of its
+ * capacity taken since it last filled up is hot, and doubles its capacity instead of being flushed (up to
+ * QL_CAPACITY_MAX). Otherwise only the colder half is flushed, the blocks freed longest ago, and a list that nothing
+ * was taken from since it last filled up halves its capacity first (down to QL_CAPACITY_MIN).
 */
-void insert_ql(sf_block * free_block) {
-    // Store unobfuscated header
-    sf_header header = OBF(free_block -> header);
+void insert_ql(sf_arena *arena, sf_block *block) {
     // Grab block size
-    size_t block_size = GET_BLOCK_SIZE(header);
+    size_t block_size = GET_BLOCK_SIZE(OBF(block -> header));
 
     // Grab index
     int index = QL_INDEX(block_size);
 
+    // Set QL and alloc bit of header first (and footer, unless footers are elided), so that flushing below can't
+    // mistake this block for a free neighbour (it isn't in any list yet)
+    set_header(block, PACK(0, block_size, 1, 1));
+
     // Grab list struct
-    int length = sf_quick_lists[index].length;
-    if(length == 5) {
-        // List should be flushed here (all the pointers should be coalesced and inserted back into the main list)
-        flush_ql(index);
+    struct sf_quick_list *list = arena -> quick_lists + index;
+    int *capacity = arena -> ql_capacity + index;
+    if(list -> length >= *capacity) {
+        int pops = arena -> ql_pops[index];
+        arena -> ql_pops[index] = 0;
+        if(pops >= *capacity / 2 && *capacity < QL_CAPACITY_MAX) {
+            *capacity = *capacity * 2 < QL_CAPACITY_MAX ? *capacity * 2 : QL_CAPACITY_MAX;
+        } else {
+            if(pops == 0 && *capacity > QL_CAPACITY_MIN)
+                *capacity = *capacity / 2 > QL_CAPACITY_MIN ? *capacity / 2 : QL_CAPACITY_MIN;
+            // Blocks past the first half of the capacity are coalesced and inserted back into the main list
+            flush_ql(arena, index, *capacity / 2);
+        }
     }
-    // Can be added to list otherwise
-    // Set QL and alloc bit of header
-    free_block -> header = OBF(header | IN_QUICK_LIST | THIS_BLOCK_ALLOCATED);
 
     // Insert into list
-    sf_block *prev_first = sf_quick_lists[index].first;
-    sf_quick_lists[index].first = free_block;
-    free_block -> body.links.next = prev_first;
+    block -> body.links.next = list -> first;
+    list -> first = block;
     
     //Increment length
-    sf_quick_lists[index].length++;
+    list -> length++;
 }
 
 /**
- * @brief Will flush the quick list of the given head (insert each QL into the respective main list)
+ * @brief Will flush the quick list of the given index (insert its blocks into the respective main list), except for
+ * the first keep blocks, which are the ones freed most recently
  * @param index, index of the given QL to flush 
+ * @param keep, number of blocks left in the list
  */
-void flush_ql(int index) {
+void flush_ql(sf_arena *arena, int index, int keep) {
     if(index > NUM_QUICK_LISTS) {
         fprintf(stderr, "Invalid QL index");
         return;
     }
 
-    // Grab "first" pointer
-    sf_block *cur = sf_quick_lists[index].first;
-    while(cur != NULL) {
-        // Set QL first to the next one
-        sf_quick_lists[index].first = cur -> body.links.next;
+    // Find the link to the first block that goes
+    struct sf_quick_list *list = arena -> quick_lists + index;
+    sf_block **link = &list -> first;
+    for(int i = 0; i < keep && *link; i++) link = &(*link) -> body.links.next;
+    sf_block *cur = *link;
+    *link = NULL;
+    if(list -> length > keep) list -> length = keep;
 
+    while(cur != NULL) {
+        sf_block *next = cur -> body.links.next;
         // Unlink cur
         cur -> body.links.next = NULL;
-        // Coalesce cur
-        cur = coalesce(cur);
+        // Turn it back into a free block (clears the QL and alloc bits) and coalesce it
+        cur = create_free_block(GET_BLOCK_SIZE(OBF(cur -> header)), (char *)cur);
+        cur = coalesce(arena, cur);
         // Insert cur into main list
-        insert_ml(cur);
+        insert_ml(arena, cur);
 
-        // Set cur back to the QL first
-        cur = sf_quick_lists[index].first;
+        cur = next;
     } 
 }
 
@@ -746,22 +2795,26 @@ void flush_ql(int index) {
  * I think this is better personally as I feel like insertion shouldn't be abstracted away into this 
  * function or else it leads to the code being weird/unreadable I guess
  */
-sf_block *coalesce(sf_block *free_block) {
-    // Grab prev block and prevHdr
-    sf_block *prev = PREV_BLOCK(free_block);
-    sf_header prevHdr = OBF(prev -> header);
-
+sf_block *coalesce(sf_arena *arena, sf_block *free_block) {
+    sf_header header = OBF(free_block -> header);
     // Grab block size
-    size_t block_size = GET_BLOCK_SIZE(OBF(free_block -> header));
+    size_t block_size = GET_BLOCK_SIZE(header);
+
+    // Grab prev block and prevHdr, the previous block only has a footer to find it by if it's free
+    int prevAlloc = PREV_ALLOC(header);
+    sf_block *prev = prevAlloc ? NULL : PREV_BLOCK(free_block);
+    sf_header prevHdr = prevAlloc ? 0 : OBF(prev -> header);
 
     // Grab next block and nextHdr
     sf_block* next = NEXT_BLOCK(free_block);
     sf_header nextHdr = OBF(next -> header);
 
-    // Grab each header/footer's allocation bit
+    // Grab next header's allocation bit
     int nextAlloc = nextHdr & THIS_BLOCK_ALLOCATED;
-    int prevAlloc = prevHdr & THIS_BLOCK_ALLOCATED;
     
+    // If anything is merged, the header and links of the last block merged are left inside the new block
+    if(!prevAlloc || !nextAlloc) mark_used(arena, (char *)(nextAlloc ? free_block : next) + 3 * MROW);
+
     // Case 1: both prev and next are allocated
     if(prevAlloc && nextAlloc) return free_block;
 
@@ -771,14 +2824,10 @@ sf_block *coalesce(sf_block *free_block) {
         block_size += GET_BLOCK_SIZE(nextHdr);
 
         // Remove next block from it's corresponding list, it can only be in a main list because a quick list block wouldn't be free
-        int ret = remove_ml(next); 
-        if(ret) fprintf(stderr, "Failed to find next block to remove while coalescing");
-
-        // Pack header with new size
-        free_block -> header = OBF(PACK(0, block_size, 0, 0));        
-        // Pack footer with new size
-        sf_footer * footer = FOOTER(free_block);
-        *footer = free_block -> header;
+        detach_ml(arena, next, "next");
+
+        // Pack header and footer with new size
+        set_header(free_block, PACK(0, block_size, 0, 0));
         return free_block;
     }
 
@@ -788,14 +2837,10 @@ sf_block *coalesce(sf_block *free_block) {
         block_size += GET_BLOCK_SIZE(prevHdr);
         
         // Remove prev from it's old list
-        int ret = remove_ml(prev);
-        if(ret) fprintf(stderr, "Failed to find prev block to remove while coalescing");
-
-        // Pack header with new size
-        prev -> header = OBF(PACK(0, block_size, 0, 0));
-        // Pack footer with new size
-        sf_footer * footer = FOOTER(prev);
-        *footer = prev -> header;
+        detach_ml(arena, prev, "prev");
+
+        // Pack header and footer with new size
+        set_header(prev, PACK(0, block_size, 0, 0));
         return prev;
     }
 
@@ -806,17 +2851,113 @@ sf_block *coalesce(sf_block *free_block) {
         block_size += GET_BLOCK_SIZE(prevHdr) + GET_BLOCK_SIZE(nextHdr);
         
         // Remove next block from it's corresponding list, it can only be in a main list because a quick list block wouldn't be free
-        int ret = remove_ml(next); 
-        if(ret) fprintf(stderr, "Failed to find next block to remove while coalescing");
+        detach_ml(arena, next, "next");
         // Remove prev from it's old list
-        ret = remove_ml(prev);
-        if(ret) fprintf(stderr, "Failed to find prev block to remove while coalescing");
-
-        // Pack header with new size
-        prev -> header = OBF(PACK(0, block_size, 0, 0));
-        // Pack footer with new size
-        sf_footer *footer = FOOTER(prev);
-        *footer = prev -> header;
+        detach_ml(arena, prev, "prev");
+
+        // Pack header and footer with new size
+        set_header(prev, PACK(0, block_size, 0, 0));
         return prev;
     }
-}
\ No newline at end of file
+}
+/*
+ * Functions to display the contents of the heap in a human-readable form.
+ * These were part of the prebuilt sfutil binary originally, they're written here since they need the macros above.
+ */
+
+void sf_show_block(sf_block *bp) {
+    sf_header header = OBF(bp -> header);
+    fprintf(stderr, "[%p] %s block_size: %zu, payload_size: %zu%s",
+            (void *)bp,
+            (header & THIS_BLOCK_ALLOCATED) ? "allocated" : "free",
+            GET_BLOCK_SIZE(header),
+            (size_t)GET_PL_SIZE(header),
+            (header & IN_QUICK_LIST) ? ", in quick list" : "");
+}
+
+/**
+ * @brief Returns whether the arena's heap has been initialized, i.e. whether there's anything to show
+ */
+int arena_used(sf_arena *arena) {
+    return HEAP_SIZE(arena) != 0 || SLAB_AREA_SIZE(arena) != 0;
+}
+
+void sf_show_blocks() {
+    if(heaps_empty()) {
+        fprintf(stderr, "(heap not initialized)\n");
+        return;
+    }
+    for(sf_arena *arena = arenas; arena < arenas + SF_MAX_ARENAS; arena++) {
+        if(!arena_used(arena)) continue;
+        fprintf(stderr, "arena %d:\n", ARENA_INDEX(arena));
+        // Same walk as sf_fragmentation(): from the first block after the prologue up to the epilogue
+        if(HEAP_SIZE(arena) != 0) {
+            sf_block *cur = (sf_block *)(HEAP_START(arena) + 5 * MROW);
+            sf_block *epilogue = (sf_block *)(HEAP_END(arena) - MROW);
+            while(cur != epilogue) {
+                sf_show_block(cur);
+                fprintf(stderr, "\n");
+                cur = NEXT_BLOCK(cur);
+            }
+        }
+        // Then every slab page (pages that were never used have no object size)
+        for(char *page = sf_slab_start(ARENA_INDEX(arena)); page < (char *)sf_slab_end(ARENA_INDEX(arena)); page += PAGE_SZ) {
+            struct sf_slab *slab = (struct sf_slab *)page;
+            if(!slab -> obj_size) continue;
+            fprintf(stderr, "[%p] slab object_size: %u, in use: %u/%u\n",
+                    (void *)slab, slab -> obj_size, slab -> used, slab -> capacity);
+        }
+    }
+}
+
+void sf_show_free_list(int index) {
+    for(sf_arena *arena = arenas; arena < arenas + SF_MAX_ARENAS; arena++) {
+        if(!arena_used(arena)) continue;
+        sf_block *sentinel = arena -> free_list_heads + index;
+        fprintf(stderr, "%d (arena %d):", index, ARENA_INDEX(arena));
+        for(sf_block *cur = sentinel -> body.links.next; cur != sentinel; cur = cur -> body.links.next) {
+            fprintf(stderr, "\n  ");
+            sf_show_block(cur);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+void sf_show_free_lists() {
+    for(int i = 0; i < NUM_FREE_LISTS; i++) {
+        // Only show the lists the bitmaps say are non-empty in some arena
+        int used = 0;
+        for(sf_arena *arena = arenas; arena < arenas + SF_MAX_ARENAS; arena++)
+            used |= arena_used(arena) && (arena -> sl_bitmap[i / SL_COUNT] & (1U << (i % SL_COUNT)));
+        if(used) sf_show_free_list(i);
+    }
+}
+
+void sf_show_quick_list(int index) {
+    for(sf_arena *arena = arenas; arena < arenas + SF_MAX_ARENAS; arena++) {
+        if(!arena_used(arena)) continue;
+        fprintf(stderr, "%d (arena %d, length %d, capacity %d):", index, ARENA_INDEX(arena),
+                arena -> quick_lists[index].length, arena -> ql_capacity[index]);
+        for(sf_block *cur = arena -> quick_lists[index].first; cur != NULL; cur = cur -> body.links.next) {
+            fprintf(stderr, "\n  ");
+            sf_show_block(cur);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+void sf_show_quick_lists() {
+    for(int i = 0; i < NUM_QUICK_LISTS; i++) {
+        sf_show_quick_list(i);
+    }
+}
+
+void sf_show_heap() {
+    fprintf(stderr, "---------- BLOCKS ----------\n");
+    sf_show_blocks();
+    fprintf(stderr, "-------- FREE LISTS --------\n");
+    sf_show_free_lists();
+    fprintf(stderr, "-------- QUICK LISTS -------\n");
+    sf_show_quick_lists();
+    fprintf(stderr, "----------------------------\n");
+}
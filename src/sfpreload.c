@@ -0,0 +1,183 @@
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include "sfmm.h"
+
+/*
+ * LD_PRELOAD interposition library (libsfmm_preload.so, see `make preload`).
+ *
+ * Exports the C allocation functions, backed by sf_malloc(), sf_free() and the rest, so unmodified programs can
+ * run on the allocator:
+ *
+ *     LD_PRELOAD=./build/libsfmm_preload.so ./program
+ *
+ * The operator new/delete family is in sfpreload_new.cpp. Everything is built with the initial-exec TLS model,
+ * so thread-local variables never need __tls_get_addr(), which can allocate.
+ *
+ * The allocator may call something that allocates (the dynamic loader resolving a symbol, sysconf(),
+ * pthread_atfork()...) from inside one of these functions. Such nested calls are served from a static bootstrap
+ * buffer instead, and so are allocations made before the heap could be set up. Bootstrap memory is never reused:
+ * freeing it does nothing, and reallocating it moves it into the heap.
+ */
+
+/* Size of the bootstrap buffer */
+#ifndef SF_BOOT_SIZE
+#define SF_BOOT_SIZE (256 * 1024)
+#endif
+
+#define BOOT_HEADER 16 // Size row in front of every bootstrap allocation, keeping the payload 16-byte aligned
+
+static char boot_heap[SF_BOOT_SIZE] __attribute__((aligned(PAGE_SZ)));
+static size_t boot_used;
+// Set while the calling thread is inside the allocator, see enter()
+static __thread int busy;
+
+/**
+ * @brief Allocates from the bootstrap buffer, which is zero to begin with and never reused
+ * @param align, power of two, at least 16
+ * @returns pointer to size bytes aligned to align, NULL if the buffer is used up
+ */
+static void *boot_alloc(size_t size, size_t align) {
+    if(size > SF_BOOT_SIZE || align > SF_BOOT_SIZE) return NULL;
+    // Room for the size row in front of the payload, and for the alignment
+    size_t need = (size + BOOT_HEADER + align + 15) & ~(size_t)15;
+    size_t start = __atomic_fetch_add(&boot_used, need, __ATOMIC_RELAXED);
+    if(start + need > SF_BOOT_SIZE) return NULL;
+
+    size_t pp = ((size_t)boot_heap + start + BOOT_HEADER + align - 1) & ~(align - 1);
+    ((size_t *)pp)[-1] = size;
+    return (void *)pp;
+}
+
+static int is_boot(void *pp) {
+    return (char *)pp >= boot_heap && (char *)pp < boot_heap + SF_BOOT_SIZE;
+}
+
+static size_t boot_size(void *pp) {
+    return ((size_t *)pp)[-1];
+}
+
+/**
+ * @brief Marks the calling thread as inside the allocator
+ * @returns 0 if it was already, then the call has to be served from the bootstrap buffer
+ */
+static inline int enter() {
+    if(busy) return 0;
+    busy = 1;
+    return 1;
+}
+
+static inline void leave() {
+    busy = 0;
+}
+
+/**
+ * @brief Serves every kind of allocation: a payload of size bytes aligned to align (16 for plain malloc), from the
+ * bootstrap buffer when nested. Zero-sized requests get a payload as well, like glibc, since many programs take
+ * NULL for an error.
+ * @returns the payload, NULL if there's no memory left (errno is set to ENOMEM)
+ */
+static void *allocate(size_t size, size_t align) {
+    if(size == 0) size = 1;
+    void *pp;
+    if(!enter()) {
+        pp = boot_alloc(size, align);
+    } else {
+        pp = align <= 16 ? sf_malloc(size) : sf_aligned_alloc(align, size);
+        leave();
+    }
+    if(!pp) errno = ENOMEM;
+    return pp;
+}
+
+__attribute__((constructor))
+static void preload_init() {
+    if(!enter()) return;
+    pthread_atfork(sf_fork_prepare, sf_fork_parent, sf_fork_child);
+    leave();
+}
+
+void *malloc(size_t size) {
+    return allocate(size, 16);
+}
+
+void free(void *pp) {
+    if(!pp || is_boot(pp)) return;
+    int entered = enter();
+    sf_free(pp);
+    if(entered) leave();
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    size_t total;
+    if(__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // Bootstrap memory is never reused, so it's still zero
+    if(total == 0 || !enter()) return allocate(total, 16);
+    void *pp = sf_calloc(1, total);
+    leave();
+    if(!pp) errno = ENOMEM;
+    return pp;
+}
+
+void *realloc(void *pp, size_t size) {
+    if(!pp) return malloc(size);
+    if(size == 0) {
+        free(pp);
+        return NULL;
+    }
+    if(is_boot(pp)) {
+        void *moved = malloc(size);
+        if(moved) memcpy(moved, pp, boot_size(pp) < size ? boot_size(pp) : size);
+        return moved;
+    }
+
+    int entered = enter();
+    void *moved = sf_realloc(pp, size);
+    int error = sf_errno;
+    if(entered) leave();
+    // glibc aborts on an invalid pointer as well
+    if(!moved && error == EINVAL) abort();
+    if(!moved) errno = ENOMEM;
+    return moved;
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size) {
+    if(align == 0 || (align & (align - 1)) || align % sizeof(void *) != 0) return EINVAL;
+    void *pp = allocate(size, align < 16 ? 16 : align);
+    if(!pp) return ENOMEM;
+    *memptr = pp;
+    return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+    if(align == 0 || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return allocate(size, align < 16 ? 16 : align);
+}
+
+void *memalign(size_t align, size_t size) {
+    return aligned_alloc(align, size);
+}
+
+void *valloc(size_t size) {
+    return allocate(size, PAGE_SZ);
+}
+
+void *pvalloc(size_t size) {
+    if(size > SIZE_MAX - PAGE_SZ) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return allocate((size + PAGE_SZ - 1) & ~(PAGE_SZ - 1), PAGE_SZ);
+}
+
+size_t malloc_usable_size(void *pp) {
+    if(!pp) return 0;
+    if(is_boot(pp)) return boot_size(pp);
+    return sf_usable_size(pp);
+}
@@ -0,0 +1,113 @@
+#include <cstdlib>
+#include <new>
+
+/*
+ * The operator new/delete family of the preload library (see sfpreload.c), on top of its malloc() and free(), so
+ * C++ allocations reach the allocator without going through libstdc++'s own operators first.
+ */
+
+namespace {
+
+/**
+ * @brief The loop every throwing operator new runs: retry after the new handler, throw once there's none
+ */
+void *new_impl(std::size_t size, std::size_t align) {
+    for(;;) {
+        void *pp = align <= 16 ? std::malloc(size) : std::aligned_alloc(align, size);
+        if(pp) return pp;
+        std::new_handler handler = std::get_new_handler();
+        if(!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+void *new_nothrow(std::size_t size, std::size_t align) noexcept {
+    try {
+        return new_impl(size, align);
+    } catch(...) {
+        return nullptr;
+    }
+}
+
+}
+
+void *operator new(std::size_t size) {
+    return new_impl(size, 16);
+}
+
+void *operator new[](std::size_t size) {
+    return new_impl(size, 16);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return new_nothrow(size, 16);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return new_nothrow(size, 16);
+}
+
+void *operator new(std::size_t size, std::align_val_t align) {
+    return new_impl(size, static_cast<std::size_t>(align));
+}
+
+void *operator new[](std::size_t size, std::align_val_t align) {
+    return new_impl(size, static_cast<std::size_t>(align));
+}
+
+void *operator new(std::size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+    return new_nothrow(size, static_cast<std::size_t>(align));
+}
+
+void *operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+    return new_nothrow(size, static_cast<std::size_t>(align));
+}
+
+// Every delete is a free(), the sizes and alignments aren't needed to find the block
+void operator delete(void *pp) noexcept {
+    std::free(pp);
+}
+
+void operator delete[](void *pp) noexcept {
+    std::free(pp);
+}
+
+void operator delete(void *pp, std::size_t) noexcept {
+    std::free(pp);
+}
+
+void operator delete[](void *pp, std::size_t) noexcept {
+    std::free(pp);
+}
+
+void operator delete(void *pp, const std::nothrow_t &) noexcept {
+    std::free(pp);
+}
+
+void operator delete[](void *pp, const std::nothrow_t &) noexcept {
+    std::free(pp);
+}
+
+void operator delete(void *pp, std::align_val_t) noexcept {
+    std::free(pp);
+}
+
+void operator delete[](void *pp, std::align_val_t) noexcept {
+    std::free(pp);
+}
+
+void operator delete(void *pp, std::size_t, std::align_val_t) noexcept {
+    std::free(pp);
+}
+
+void operator delete[](void *pp, std::size_t, std::align_val_t) noexcept {
+    std::free(pp);
+}
+
+void operator delete(void *pp, std::align_val_t, const std::nothrow_t &) noexcept {
+    std::free(pp);
+}
+
+void operator delete[](void *pp, std::align_val_t, const std::nothrow_t &) noexcept {
+    std::free(pp);
+}
@@ -0,0 +1,437 @@
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sfmm.h"
+
+/*
+ * Sampling heap profiler for the allocator in sfmm.c (see sfmm.h).
+ *
+ * Every thread counts down the bytes it allocates, and when the count runs out the allocation is
+ * sampled and a new count is drawn from an exponential distribution with the requested mean, so
+ * every byte has the same chance of being sampled wherever it is in the allocation stream.
+ *
+ * A sample (the payload address, requested size and backtrace) lives in a hash table keyed by
+ * address until the payload is freed. Nodes come from a pool mapped on first use, nothing here
+ * allocates through sf_malloc() or stdio, so the profiler can't recurse into the allocator and a
+ * dump can be written from a signal handler.
+ */
+
+/* Most samples that can be live at once, later ones are dropped */
+#ifndef SF_PROF_MAX_SAMPLES
+#define SF_PROF_MAX_SAMPLES (1 << 16)
+#endif
+
+/* Most frames kept per backtrace */
+#ifndef SF_PROF_DEPTH
+#define SF_PROF_DEPTH 32
+#endif
+
+#define BUCKETS 4096            // Hash buckets of live samples (a power of 2)
+#define STRIPES 64              // Locks protecting the buckets, bucket b is protected by stripe b % STRIPES
+#define BUCKET_OF(ptr) (((size_t)(ptr) >> 4) * 0x9E3779B97F4A7C15ULL >> 52) /* Top 12 bits of the hash */
+
+struct sample {
+    struct sample *next;        // Next sample in the bucket, or in the pool's free list
+    void *ptr;                  // Sampled payload
+    size_t size;                // Requested size
+    uint64_t hash;              // Hash of the backtrace, for grouping samples in a dump
+    int depth;
+    void *stack[SF_PROF_DEPTH];
+};
+
+// Samples with the same backtrace, added up while writing a dump
+struct site {
+    uint64_t hash;
+    long count;
+    long bytes;
+    int depth;
+    void *stack[SF_PROF_DEPTH];
+};
+
+int sf_prof_active = 0;
+static size_t prof_interval;
+
+static struct sample *buckets[BUCKETS];
+static pthread_mutex_t stripes[STRIPES] = { [0 ... STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER };
+static long live_samples;
+
+// Pool of sample nodes: never used ones start at pool_used, released ones are on pool_free
+static struct sample *pool;
+static size_t pool_used;
+static struct sample *pool_free;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Per-thread sampling state
+static __thread long bytes_until_sample;
+static __thread uint64_t rng_state;
+static __thread int in_sampler;     // Set while sampling, so allocations made by backtrace() aren't sampled
+
+// Where a dump requested by signal goes
+static char signal_path[4096];
+
+static void record(void *pp, size_t size);
+static void forget(void *pp);
+static long next_interval();
+static double log_uniform();
+static void clear_samples();
+static void dump_signal_handler(int signum);
+static int write_profile(int fd, int from_signal);
+
+int sf_prof_start(size_t interval) {
+    if(interval == 0) {
+        sf_errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&pool_lock);
+    if(!pool) {
+        void *mem = mmap(NULL, SF_PROF_MAX_SAMPLES * sizeof(struct sample), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(mem == MAP_FAILED) {
+            pthread_mutex_unlock(&pool_lock);
+            sf_errno = ENOMEM;
+            return -1;
+        }
+        pool = mem;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    // The first backtrace() call may load libgcc (and allocate), get that out of the way now
+    void *warmup[1];
+    backtrace(warmup, 1);
+
+    __atomic_store_n(&prof_interval, interval, __ATOMIC_RELAXED);
+    __atomic_store_n(&sf_prof_active, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void sf_prof_stop() {
+    __atomic_store_n(&sf_prof_active, 0, __ATOMIC_RELAXED);
+    // Frees aren't tracked anymore, so the samples would go stale
+    clear_samples();
+}
+
+/**
+ * @brief Hook for sf_malloc(), called for every successful allocation while the profiler is active
+ */
+void sf_prof_malloc(void *pp, size_t size) {
+    if(in_sampler) return;
+    if(!rng_state) {
+        // Seeded from the thread's own address and the clock, so threads don't sample in step
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        rng_state = ((uint64_t)&rng_state ^ ((uint64_t)ts.tv_nsec << 20) ^ ts.tv_sec) | 1;
+        bytes_until_sample = next_interval();
+    }
+    bytes_until_sample -= size;
+    if(bytes_until_sample > 0) return;
+
+    bytes_until_sample = next_interval();
+    in_sampler = 1;
+    record(pp, size);
+    in_sampler = 0;
+}
+
+/**
+ * @brief Hook for sf_realloc(), when a payload is resized in place or moved without going through sf_malloc()
+ */
+void sf_prof_realloc(void *old_pp, void *new_pp, size_t size) {
+    forget(old_pp);
+    sf_prof_malloc(new_pp, size);
+}
+
+/**
+ * @brief Hook for sf_free(), called for every (valid) free while the profiler is active
+ */
+void sf_prof_free(void *pp) {
+    forget(pp);
+}
+
+/**
+ * @brief Takes a backtrace and adds a sample for pp to the table
+ */
+__attribute__((noinline))
+static void record(void *pp, size_t size) {
+    pthread_mutex_lock(&pool_lock);
+    struct sample *s = pool_free;
+    if(s) pool_free = s -> next;
+    else if(pool && pool_used < SF_PROF_MAX_SAMPLES) s = pool + pool_used++;
+    pthread_mutex_unlock(&pool_lock);
+    // The table is full, the sample is dropped
+    if(!s) return;
+
+    // The first frame is this function, the allocator's own frames are left for pprof to trim
+    void *stack[SF_PROF_DEPTH + 1];
+    int depth = backtrace(stack, SF_PROF_DEPTH + 1) - 1;
+    s -> ptr = pp;
+    s -> size = size;
+    s -> depth = depth > 0 ? depth : 0;
+    s -> hash = 1469598103934665603ULL;
+    for(int i = 0; i < s -> depth; i++) {
+        s -> stack[i] = stack[i + 1];
+        s -> hash = (s -> hash ^ (uint64_t)stack[i + 1]) * 1099511628211ULL;
+    }
+
+    size_t b = BUCKET_OF(pp);
+    pthread_mutex_lock(stripes + b % STRIPES);
+    s -> next = buckets[b];
+    __atomic_store_n(buckets + b, s, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(stripes + b % STRIPES);
+    __atomic_add_fetch(&live_samples, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Removes the sample for pp, if there is one
+ */
+static void forget(void *pp) {
+    size_t b = BUCKET_OF(pp);
+    // Most buckets are empty unless there are thousands of live samples, so most frees stop here
+    if(!__atomic_load_n(buckets + b, __ATOMIC_ACQUIRE)) return;
+
+    pthread_mutex_lock(stripes + b % STRIPES);
+    struct sample **link = buckets + b;
+    while(*link && (*link) -> ptr != pp) link = &(*link) -> next;
+    struct sample *s = *link;
+    if(s) __atomic_store_n(link, s -> next, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(stripes + b % STRIPES);
+    if(!s) return;
+
+    __atomic_sub_fetch(&live_samples, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool_lock);
+    s -> next = pool_free;
+    pool_free = s;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief Draws the number of bytes until the next sample, exponentially distributed around the interval
+ */
+static long next_interval() {
+    double interval = __atomic_load_n(&prof_interval, __ATOMIC_RELAXED);
+    long bytes = (long)(-log_uniform() * interval) + 1;
+    return bytes > 0 ? bytes : 1;
+}
+
+/**
+ * @brief Returns the natural log of a uniform random number in (0, 1], without needing libm
+ */
+static double log_uniform() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    double u = ((rng_state >> 11) + 1) * (1.0 / 9007199254740992.0);
+
+    // u = m * 2^e with m in [1, 2), then ln(m) = 2 * atanh((m - 1) / (m + 1)), whose series converges quickly
+    uint64_t bits;
+    memcpy(&bits, &u, sizeof(bits));
+    int e = (int)((bits >> 52) & 0x7FF) - 1023;
+    bits = (bits & 0xFFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+    double z = (m - 1) / (m + 1), z2 = z * z, term = z, sum = 0;
+    for(int k = 1; k < 20; k += 2) {
+        sum += term / k;
+        term *= z2;
+    }
+    return 2 * sum + e * 0.6931471805599453;
+}
+
+/**
+ * @brief Returns every sample to the pool
+ */
+static void clear_samples() {
+    for(size_t b = 0; b < BUCKETS; b++) {
+        pthread_mutex_lock(stripes + b % STRIPES);
+        struct sample *s = buckets[b];
+        __atomic_store_n(buckets + b, NULL, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(stripes + b % STRIPES);
+        while(s) {
+            struct sample *next = s -> next;
+            __atomic_sub_fetch(&live_samples, 1, __ATOMIC_RELAXED);
+            pthread_mutex_lock(&pool_lock);
+            s -> next = pool_free;
+            pool_free = s;
+            pthread_mutex_unlock(&pool_lock);
+            s = next;
+        }
+    }
+}
+
+/*
+ * Fork handlers, see sf_fork_prepare(): every lock is taken in the order the profiler nests them (a stripe, then
+ * the pool), and released in reverse.
+ */
+void sf_prof_fork_lock() {
+    for(int i = 0; i < STRIPES; i++) pthread_mutex_lock(stripes + i);
+    pthread_mutex_lock(&pool_lock);
+}
+
+void sf_prof_fork_unlock() {
+    pthread_mutex_unlock(&pool_lock);
+    for(int i = STRIPES - 1; i >= 0; i--) pthread_mutex_unlock(stripes + i);
+}
+
+int sf_prof_dump(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return -1;
+    int ret = write_profile(fd, 0);
+    if(close(fd)) ret = -1;
+    return ret;
+}
+
+int sf_prof_dump_on_signal(int signum, const char *path) {
+    if(!path || strlen(path) >= sizeof(signal_path)) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(signal_path, path);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dump_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(signum, &sa, NULL);
+}
+
+static void dump_signal_handler(int signum) {
+    (void) signum;
+    int saved_errno = errno;
+    int fd = open(signal_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd >= 0) {
+        write_profile(fd, 1);
+        close(fd);
+    }
+    errno = saved_errno;
+}
+
+/*
+ * Output: the profile is written in the text format of gperftools' heap profiles, which pprof reads directly.
+ * Formatting is done by hand into a buffer, since stdio isn't safe in a signal handler.
+ */
+
+struct out {
+    int fd;
+    int error;
+    size_t len;
+    char buf[4096];
+};
+
+static void out_flush(struct out *out) {
+    size_t done = 0;
+    while(done < out -> len && !out -> error) {
+        ssize_t n = write(out -> fd, out -> buf + done, out -> len - done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) out -> error = 1;
+        else done += n;
+    }
+    out -> len = 0;
+}
+
+static void out_str(struct out *out, const char *str) {
+    while(*str) {
+        if(out -> len == sizeof(out -> buf)) out_flush(out);
+        out -> buf[out -> len++] = *str++;
+    }
+}
+
+static void out_num(struct out *out, unsigned long value, int base) {
+    char digits[24];
+    int i = sizeof(digits) - 1;
+    digits[i] = '\0';
+    do {
+        digits[--i] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while(value);
+    if(base == 16) out_str(out, "0x");
+    out_str(out, digits + i);
+}
+
+// One "count: bytes [count: bytes]" pair, the allocation totals aren't kept so the second one is 0: 0
+static void out_counts(struct out *out, long count, long bytes) {
+    out_num(out, count, 10);
+    out_str(out, ": ");
+    out_num(out, bytes, 10);
+    out_str(out, " [0: 0] @");
+}
+
+/**
+ * @brief Writes the profile to fd: the sampled live allocations grouped by backtrace, followed by the memory map
+ * @param from_signal, whether this runs in a signal handler, in which case buckets whose lock is held are skipped
+ * rather than waited for (the interrupted thread may be the one holding it)
+ * @returns 0 on success, -1 if anything couldn't be written
+ */
+static int write_profile(int fd, int from_signal) {
+    // Room for every live sample with the table at most half full, the count can grow a little while it's filled
+    long live = __atomic_load_n(&live_samples, __ATOMIC_RELAXED);
+    size_t capacity = 64;
+    while(capacity < 2 * (size_t)live + 64) capacity *= 2;
+    size_t map_size = capacity * sizeof(struct site);
+    struct site *sites = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(sites == MAP_FAILED) return -1;
+
+    long total_count = 0, total_bytes = 0;
+    size_t used = 0;
+    for(size_t b = 0; b < BUCKETS; b++) {
+        if(!__atomic_load_n(buckets + b, __ATOMIC_ACQUIRE)) continue;
+        pthread_mutex_t *lock = stripes + b % STRIPES;
+        if(from_signal ? pthread_mutex_trylock(lock) : pthread_mutex_lock(lock)) continue;
+        for(struct sample *s = buckets[b]; s; s = s -> next) {
+            // Open addressing on the backtrace hash, samples with the same backtrace are added up
+            size_t i = s -> hash & (capacity - 1);
+            while(sites[i].count && (sites[i].hash != s -> hash || sites[i].depth != s -> depth ||
+                  memcmp(sites[i].stack, s -> stack, s -> depth * sizeof(void *))))
+                i = (i + 1) & (capacity - 1);
+            if(!sites[i].count) {
+                // Never more than half full, anything past that is left out
+                if(2 * used >= capacity) continue;
+                used++;
+                sites[i].hash = s -> hash;
+                sites[i].depth = s -> depth;
+                memcpy(sites[i].stack, s -> stack, s -> depth * sizeof(void *));
+            }
+            sites[i].count++;
+            sites[i].bytes += s -> size;
+            total_count++;
+            total_bytes += s -> size;
+        }
+        pthread_mutex_unlock(lock);
+    }
+
+    struct out out = { .fd = fd };
+    out_str(&out, "heap profile: ");
+    out_counts(&out, total_count, total_bytes);
+    out_str(&out, " heap_v2/");
+    out_num(&out, __atomic_load_n(&prof_interval, __ATOMIC_RELAXED), 10);
+    out_str(&out, "\n");
+    for(size_t i = 0; i < capacity; i++) {
+        if(!sites[i].count) continue;
+        out_counts(&out, sites[i].count, sites[i].bytes);
+        for(int k = 0; k < sites[i].depth; k++) {
+            out_str(&out, " ");
+            out_num(&out, (size_t)sites[i].stack[k], 16);
+        }
+        out_str(&out, "\n");
+    }
+    munmap(sites, map_size);
+
+    // pprof needs the mappings to symbolize the addresses
+    out_str(&out, "\nMAPPED_LIBRARIES:\n");
+    out_flush(&out);
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if(maps < 0) return -1;
+    ssize_t n = 0;
+    while(!out.error && ((n = read(maps, out.buf, sizeof(out.buf))) > 0 || (n < 0 && errno == EINTR))) {
+        if(n < 0) continue;
+        out.len = n;
+        out_flush(&out);
+    }
+    close(maps);
+    return out.error || n < 0 ? -1 : 0;
+}
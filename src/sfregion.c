@@ -0,0 +1,147 @@
+#include <errno.h>
+#include <stdint.h>
+#include "sfmm.h"
+
+/*
+ * Regions (see sfmm.h): bump allocation inside chunks that are ordinary sf_malloc() payloads.
+ *
+ * A region keeps its chunks in a list, the ones up to the current chunk are (partly) used and the ones
+ * after it are empty. An allocation bumps a pointer in the current chunk, and moves on to the next chunk,
+ * or links a new one after the current one, once it doesn't fit. Objects have no header of their own and
+ * are never freed one by one: a reset just moves the bump pointer back to the start of the first chunk.
+ *
+ * Objects larger than a quarter of a chunk get a chunk of their own sized for them, kept in a separate
+ * list and freed on reset, so one large object neither wastes the rest of the current chunk nor stays
+ * around as a chunk of the wrong size.
+ */
+
+#define REGION_ALIGN 16 // Alignment of every object, the same as sf_malloc()'s
+
+struct sf_region_chunk {
+    struct sf_region_chunk *next;
+    size_t size;                        // Bytes available to objects, which start right after this header
+};
+
+struct sf_region {
+    struct sf_region_chunk *chunks;     // Chunks of chunk_size bytes, in the order they're used in
+    struct sf_region_chunk *current;    // Chunk being allocated from, NULL until the first one is needed
+    struct sf_region_chunk *large;      // Chunks holding a single large object
+    char *next;                         // Bump pointer in the current chunk
+    char *end;                          // End of the current chunk
+    size_t chunk_size;
+};
+
+static void *region_refill(sf_region *region, size_t size);
+static void *large_alloc(sf_region *region, size_t size);
+static struct sf_region_chunk *new_chunk(size_t size);
+static void free_chunks(struct sf_region_chunk *chunk);
+
+// Objects start right after the chunk header, which keeps them as aligned as the payload it is in
+_Static_assert(sizeof(struct sf_region_chunk) % REGION_ALIGN == 0, "chunk header must keep objects aligned");
+
+#define CHUNK_START(chunk) ((char *)(chunk) + sizeof(struct sf_region_chunk))
+
+sf_region *sf_region_create(size_t chunk_size) {
+    if(chunk_size == 0) chunk_size = SF_REGION_CHUNK_SIZE;
+    if(chunk_size > SIZE_MAX / 2) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    sf_region *region = sf_malloc(sizeof(sf_region));
+    if(!region) return NULL;
+    region -> chunks = NULL;
+    region -> current = NULL;
+    region -> large = NULL;
+    region -> next = NULL;
+    region -> end = NULL;
+    region -> chunk_size = (chunk_size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+    return region;
+}
+
+void *sf_region_alloc(sf_region *region, size_t size) {
+    if(size == 0) return NULL;
+    if(size > SIZE_MAX / 2) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    size = (size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+    // The common case, the object fits in the current chunk
+    if(size <= (size_t)(region -> end - region -> next)) {
+        void *pp = region -> next;
+        region -> next += size;
+        return pp;
+    }
+    return region_refill(region, size);
+}
+
+/**
+ * @brief Allocates an object that doesn't fit in the rest of the current chunk, from the next chunk
+ * @param size, a multiple of REGION_ALIGN
+ * @returns the object, NULL if memory ran out (sf_errno is set to ENOMEM)
+ */
+static void *region_refill(sf_region *region, size_t size) {
+    if(size > region -> chunk_size / 4) return large_alloc(region, size);
+
+    struct sf_region_chunk *chunk = region -> current ? region -> current -> next : region -> chunks;
+    // Past the last chunk, link a new one after the current one
+    if(!chunk) {
+        chunk = new_chunk(region -> chunk_size);
+        if(!chunk) return NULL;
+        if(region -> current) region -> current -> next = chunk;
+        else region -> chunks = chunk;
+    }
+    region -> current = chunk;
+    region -> next = CHUNK_START(chunk) + size;
+    region -> end = CHUNK_START(chunk) + chunk -> size;
+    return CHUNK_START(chunk);
+}
+
+/**
+ * @brief Allocates a large object in a chunk of its own, leaving the current chunk as it is
+ */
+static void *large_alloc(sf_region *region, size_t size) {
+    struct sf_region_chunk *chunk = new_chunk(size);
+    if(!chunk) return NULL;
+    chunk -> next = region -> large;
+    region -> large = chunk;
+    return CHUNK_START(chunk);
+}
+
+/**
+ * @brief Allocates a chunk with room for size bytes of objects
+ * @returns the chunk, not linked anywhere yet, NULL if memory ran out (sf_errno is set to ENOMEM)
+ */
+static struct sf_region_chunk *new_chunk(size_t size) {
+    struct sf_region_chunk *chunk = sf_malloc(sizeof(struct sf_region_chunk) + size);
+    if(!chunk) return NULL;
+    chunk -> next = NULL;
+    chunk -> size = size;
+    return chunk;
+}
+
+void sf_region_reset(sf_region *region) {
+    free_chunks(region -> large);
+    region -> large = NULL;
+    // The chunks are kept, and used again from the first one
+    region -> current = region -> chunks;
+    if(region -> current) {
+        region -> next = CHUNK_START(region -> current);
+        region -> end = region -> next + region -> current -> size;
+    }
+}
+
+void sf_region_destroy(sf_region *region) {
+    if(!region) return;
+    free_chunks(region -> chunks);
+    free_chunks(region -> large);
+    sf_free(region);
+}
+
+static void free_chunks(struct sf_region_chunk *chunk) {
+    while(chunk) {
+        struct sf_region_chunk *next = chunk -> next;
+        // The chunk's size is known, so the checks sf_free() makes can be skipped
+        sf_free_sized(chunk, sizeof(struct sf_region_chunk) + chunk -> size);
+        chunk = next;
+    }
+}
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sfmm.h"
+
+/*
+ * Heap provider for the allocator in sfmm.c.
+ *
+ * One large range of virtual memory is reserved up front with mmap(PROT_NONE), so the heaps never
+ * move and never collide with other mappings. The range is split into SF_MAX_ARENAS slices of
+ * SF_HEAP_RESERVE bytes, one heap per slice, so the heap a pointer belongs to is found with a
+ * subtraction and a shift. Pages are only committed (made readable/writable) as a heap grows, so the
+ * reservation costs nothing until it's used, and uncommitted again if the heap shrinks. Heap 0 is the
+ * one sf_mem_start()/sf_mem_end() refer to.
+ *
+ * After the heaps, the range has one more slice of SF_SLAB_RESERVE bytes per heap for slab pages, which
+ * grow the same way but are never part of a heap.
+ *
+ * With SF_HUGE_PAGES, the range starts on a huge page boundary (so does every slice, their sizes being
+ * multiples of HUGE_PAGE_SZ) and is marked with MADV_HUGEPAGE, which the parts committed later inherit.
+ * Keeping the heap ends on huge page boundaries is up to sfmm.c.
+ */
+
+/* Size of one heap's slice. Block sizes are stored in 32 bits, so a heap is capped at 4GB */
+#ifndef SF_HEAP_RESERVE
+#define SF_HEAP_RESERVE ((size_t)1 << 32)
+#endif
+
+/* Size of one heap's slab slice */
+#ifndef SF_SLAB_RESERVE
+#define SF_SLAB_RESERVE ((size_t)1 << 30)
+#endif
+
+#define SPAN_SIZE (SF_MAX_ARENAS * (SF_HEAP_RESERVE + SF_SLAB_RESERVE))
+
+static char *span_start = NULL;            // Start of the reserved range (and of heap 0)
+static char *heap_ends[SF_MAX_ARENAS];     // End of the committed part of each heap
+static char *slab_start = NULL;            // Start of the slab slices, right after the heaps
+static char *slab_ends[SF_MAX_ARENAS];     // End of the committed part of each slab slice
+
+static sf_header magic = 0;
+unsigned long sf_mem_generation = 0;       // Number of sf_mem_fini() calls, see sfmm.h
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;   // Serializes sf_mem_init()
+
+/**
+ * @brief Maps the (inaccessible) heap range, aligned to a huge page with SF_HUGE_PAGES
+ * @returns the start of the range, NULL on failure
+ */
+static void *reserve_span() {
+    size_t extra = SF_HUGE_PAGES ? HUGE_PAGE_SZ : 0;
+    char *base = mmap(NULL, SPAN_SIZE + extra, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(base == MAP_FAILED) return NULL;
+    if(!SF_HUGE_PAGES) return base;
+
+    // Unmap what's left over on either side of the aligned range
+    char *start = (char *)(((size_t)base + HUGE_PAGE_SZ - 1) & ~(HUGE_PAGE_SZ - 1));
+    if(start > base) munmap(base, start - base);
+    if(base + extra > start) munmap(start + SPAN_SIZE, base + extra - start);
+    // Fails without transparent huge page support, the heaps then just use small pages
+    madvise(start, SPAN_SIZE, MADV_HUGEPAGE);
+    return start;
+}
+
+/**
+ * @brief Reserves the heap range and picks the magic number. Runs automatically before main(), or on first use if
+ * something allocates before that (another constructor, or the dynamic loader when the allocator is preloaded).
+ * Calling it again after sf_mem_fini() starts over with empty heaps.
+ */
+__attribute__((constructor))
+void sf_mem_init() {
+    if(__atomic_load_n(&span_start, __ATOMIC_ACQUIRE)) return;
+    pthread_mutex_lock(&init_lock);
+    if(span_start) {
+        pthread_mutex_unlock(&init_lock);
+        return;
+    }
+
+    void *base = reserve_span();
+    if(!base) {
+        pthread_mutex_unlock(&init_lock);
+        fprintf(stderr, "sf_mem_init: unable to reserve heap range\n");
+        return;
+    }
+    slab_start = (char *)base + SF_MAX_ARENAS * SF_HEAP_RESERVE;
+    for(int i = 0; i < SF_MAX_ARENAS; i++) {
+        heap_ends[i] = (char *)base + i * SF_HEAP_RESERVE;
+        slab_ends[i] = slab_start + i * SF_SLAB_RESERVE;
+    }
+
+    // Any value works as long as it's not predictable, mix the clock with the address of the range
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    magic = ((sf_header)ts.tv_nsec << 32) ^ (sf_header)ts.tv_sec ^ (sf_header)base ^ (sf_header)getpid();
+    // Published last, so a thread that sees the range also sees everything above
+    __atomic_store_n(&span_start, (char *)base, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&init_lock);
+}
+
+/**
+ * @brief Releases the whole heap range back to the OS
+ */
+void sf_mem_fini() {
+    if(!span_start) return;
+    munmap(span_start, SPAN_SIZE);
+    span_start = NULL;
+    slab_start = NULL;
+    for(int i = 0; i < SF_MAX_ARENAS; i++) heap_ends[i] = slab_ends[i] = NULL;
+    // Tells the arenas and thread caches that what they hold is gone
+    __atomic_add_fetch(&sf_mem_generation, 1, __ATOMIC_RELEASE);
+}
+
+void *sf_mem_start() {
+    return sf_heap_start(0);
+}
+
+void *sf_mem_end() {
+    return sf_heap_end(0);
+}
+
+void *sf_mem_grow() {
+    return sf_heap_grow_n(0, 1);
+}
+
+void *sf_mem_grow_n(size_t npages) {
+    return sf_heap_grow_n(0, npages);
+}
+
+void *sf_heap_start(int heap) {
+    if(!span_start) return NULL;
+    return span_start + heap * SF_HEAP_RESERVE;
+}
+
+void *sf_heap_end(int heap) {
+    return heap_ends[heap];
+}
+
+void *sf_heap_grow_n(int heap, size_t npages) {
+    if(npages == 0) return NULL;
+    sf_mem_init();
+    if(!span_start) return NULL;
+
+    // Make sure the request fits in what's left of the slice (written this way to avoid overflow)
+    char *limit = span_start + (heap + 1) * SF_HEAP_RESERVE;
+    if(npages > (size_t)(limit - heap_ends[heap]) / PAGE_SZ) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t size = npages * PAGE_SZ;
+    // Commit the pages, the kernel only backs them once they're touched
+    if(mprotect(heap_ends[heap], size, PROT_READ | PROT_WRITE)) return NULL;
+
+    char *prev_end = heap_ends[heap];
+    heap_ends[heap] += size;
+    return prev_end;
+}
+
+void *sf_heap_shrink_n(int heap, size_t npages) {
+    if(!span_start || npages == 0) return NULL;
+
+    // The heap can't shrink past its start
+    char *start = span_start + heap * SF_HEAP_RESERVE;
+    if(npages > (size_t)(heap_ends[heap] - start) / PAGE_SZ) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t size = npages * PAGE_SZ;
+    char *new_end = heap_ends[heap] - size;
+    // Drop the pages (so they're no longer resident) and uncommit them
+    if(madvise(new_end, size, MADV_DONTNEED) || mprotect(new_end, size, PROT_NONE)) return NULL;
+
+    heap_ends[heap] = new_end;
+    return new_end;
+}
+
+int sf_heap_index(const void *ptr) {
+    size_t offset = (const char *)ptr - span_start;
+    // Unsigned, so anything below the range wraps around and fails the check as well
+    if(!span_start || offset >= SF_MAX_ARENAS * SF_HEAP_RESERVE) return -1;
+    return offset / SF_HEAP_RESERVE;
+}
+
+void *sf_slab_start(int heap) {
+    if(!slab_start) return NULL;
+    return slab_start + heap * SF_SLAB_RESERVE;
+}
+
+void *sf_slab_end(int heap) {
+    return slab_ends[heap];
+}
+
+void *sf_slab_grow_n(int heap, size_t npages) {
+    if(npages == 0) return NULL;
+    sf_mem_init();
+    if(!slab_start) return NULL;
+
+    // Same as sf_heap_grow_n(), within the heap's slab slice
+    char *limit = slab_start + (heap + 1) * SF_SLAB_RESERVE;
+    if(npages > (size_t)(limit - slab_ends[heap]) / PAGE_SZ) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t size = npages * PAGE_SZ;
+    if(mprotect(slab_ends[heap], size, PROT_READ | PROT_WRITE)) return NULL;
+
+    char *prev_end = slab_ends[heap];
+    slab_ends[heap] += size;
+    return prev_end;
+}
+
+int sf_slab_index(const void *ptr) {
+    size_t offset = (const char *)ptr - slab_start;
+    if(!slab_start || offset >= SF_MAX_ARENAS * SF_SLAB_RESERVE) return -1;
+    return offset / SF_SLAB_RESERVE;
+}
+
+sf_header sf_magic() {
+    return magic;
+}
+
+void sf_set_magic(sf_header value) {
+    magic = value;
+}